@@ -1,5 +1,8 @@
+#include <unistd.h>
 #include <time.h>
 #include <memory>
+#include <thread>
+#include <vector>
 #include <cassert>
 #include <netinet/in.h>
 #include <signal.h>
@@ -13,6 +16,7 @@
 #include <event2/util.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
+#include <event2/thread.h>
 
 using std::shared_ptr;
 
@@ -24,23 +28,53 @@ static void onAccept(evconnlistener *, evutil_socket_t,
 static void onWrite(bufferevent *, void *);
 static void onEvent(bufferevent *, short, void *);
 static void onSignal(evutil_socket_t, short, void *);
+static void usage(char *);
 
 
 int 
 main(int argc, char **argv) 
 {
 
+    int opt, threads = 1;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+            case 't': threads = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (threads < 1) usage(argv[0]);
+
+    if (threads > 1 && evthread_use_pthreads() == -1) {
+        printf("cannot enable pthreads support!\n");
+        return -1;
+    }
+
     sockaddr_in sin = {
         .sin_family = AF_INET,
         .sin_port = htons(PORT),
     };
-    auto base = shared_ptr<event_base>(event_base_new(), event_base_free);
 
-    auto listener = shared_ptr<evconnlistener>(evconnlistener_new_bind(base.get(), onAccept, (void*)base.get(),
-        LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE, -1, (sockaddr*)&sin, sizeof(sin)), 
-        evconnlistener_free);
+    // with -t every thread binds its own SO_REUSEPORT listener, so the
+    // kernel spreads incoming connections across the event loops
+    unsigned flags = LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_FREE;
+    if (threads > 1) flags |= LEV_OPT_REUSEABLE_PORT;
+
+    std::vector<shared_ptr<event_base>> bases;
+    std::vector<shared_ptr<evconnlistener>> listeners;
+    for (int i = 0; i < threads; ++i) {
+        auto base = shared_ptr<event_base>(event_base_new(), event_base_free);
+        auto listener = shared_ptr<evconnlistener>(evconnlistener_new_bind(base.get(), onAccept, (void*)base.get(),
+            flags, -1, (sockaddr*)&sin, sizeof(sin)), 
+            evconnlistener_free);
+        if (!listener) {
+            printf("cannot bind port %d!\n", PORT);
+            return -1;
+        }
+        bases.push_back(base);
+        listeners.push_back(listener);
+    }
 
-    auto sigev = shared_ptr<event>(evsignal_new(base.get(), SIGINT, onSignal, (void*)base.get()), 
+    auto sigev = shared_ptr<event>(evsignal_new(bases[0].get(), SIGINT, onSignal, (void*)&bases), 
         event_free);
     
     if (event_add(sigev.get(), NULL) == -1) {
@@ -48,7 +82,13 @@ main(int argc, char **argv)
         return -1;
     }
 
-    event_base_dispatch(base.get());
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i)
+        workers.emplace_back(event_base_dispatch, bases[i].get());
+
+    event_base_dispatch(bases[0].get());
+
+    for (auto &w : workers) w.join();
 
     printf("done!\n");
 
@@ -104,6 +144,15 @@ onSignal(evutil_socket_t fd, short events, void *data)
     printf("Caught an interrupt signal; exiting cleanly in two"
         "seconds delay...\n");
     
-    event_base_loopexit((event_base*)data, &tv);
+    auto bases = (std::vector<shared_ptr<event_base>>*)data;
+    for (auto &base : *bases)
+        event_base_loopexit(base.get(), &tv);
+}
+
+static void 
+usage(char *prog)
+{
+    printf("Usage: %s [-t threads]\n", prog);
+    exit(EXIT_FAILURE);
 }
 
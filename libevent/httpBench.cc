@@ -0,0 +1,330 @@
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/buffer.h>
+#include <event2/keyvalq_struct.h>
+#include <event2/util.h>
+#include <event2/thread.h>
+
+#define URL_MAX 4096
+
+#define VERIFY(cond) do {\
+    if (!(cond)) {  \
+        fprintf(stderr, "[%s] error!\n", #cond);\
+        exit(EXIT_FAILURE); \
+    }   \
+} while (0)
+
+struct options {
+    int         threads = 1;
+    int         conns = 1;
+    int         seconds = 5;
+    int         close = 0;
+    const char *proxy = nullptr;
+    const char *url = nullptr;
+};
+
+struct worker;
+
+/*
+ * One client connection. Through a proxy it first has to tunnel with
+ * CONNECT, and a connection that failed or was closed is started over.
+ */
+struct client {
+    worker            *w = nullptr;
+    evhttp_connection *conn = nullptr;
+    timespec           start = {};
+};
+
+struct worker {
+    event_base           *base = nullptr;
+    std::vector<client>   clients;
+    std::vector<uint32_t> latencies;
+    size_t                bytes = 0;
+    size_t                errors = 0;
+    int                   close = 0;
+};
+
+// where connections go (the proxy, if any), and what they ask for
+static std::string connHost;
+static int connPort;
+static std::string hostAndPort;
+static std::string path;
+static int viaProxy;
+
+static void usage(char *);
+static options getOpt(int, char **);
+static evhttp_uri *uriParse(const char *);
+static void startClient(client *);
+static void restartClient(evutil_socket_t, short, void *);
+static void sendGet(client *);
+static void onConnect(evhttp_request *, void *);
+static void onResponse(evhttp_request *, void *);
+static void failClient(client *);
+static double percentile(const std::vector<uint32_t> &, double);
+static void onTerm(evutil_socket_t, short, void *);
+
+int
+main(int argc, char **argv)
+{
+    auto o = getOpt(argc, argv);
+    evhttp_uri *proxy = nullptr;
+    char buff[URL_MAX];
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror("signal");
+        return 1;
+    }
+
+    if (evthread_use_pthreads() < 0) {
+        fprintf(stderr, "evthread_use_pthreads failed\n");
+        return 1;
+    }
+
+    auto location = uriParse(o.url);
+    connHost = evhttp_uri_get_host(location);
+    connPort = evhttp_uri_get_port(location);
+    evutil_snprintf(buff, sizeof(buff), "%s:%d", evhttp_uri_get_host(location),
+            evhttp_uri_get_port(location));
+    hostAndPort = buff;
+
+    // the request target is the URL without scheme, userinfo and host
+    evhttp_uri_set_scheme(location, NULL);
+    evhttp_uri_set_userinfo(location, NULL);
+    evhttp_uri_set_host(location, NULL);
+    evhttp_uri_set_port(location, -1);
+    VERIFY(evhttp_uri_join(location, buff, sizeof(buff)));
+    path = *buff ? buff : "/";
+
+    if (o.proxy) {
+        proxy = uriParse(o.proxy);
+        connHost = evhttp_uri_get_host(proxy);
+        connPort = evhttp_uri_get_port(proxy);
+        viaProxy = 1;
+    }
+
+    std::vector<worker> ws(o.threads);
+    std::vector<std::thread> threads;
+    std::vector<event_base*> bases;
+    timeval tv = { .tv_sec = o.seconds, .tv_usec = 0 };
+
+    for (int i = 0; i < o.threads; ++i) {
+        auto &w = ws[i];
+        VERIFY(w.base = event_base_new());
+        w.close = o.close;
+        w.clients.resize(o.conns / o.threads + (i < o.conns % o.threads));
+        for (auto &c : w.clients) {
+            c.w = &w;
+            startClient(&c);
+        }
+        event_base_loopexit(w.base, &tv);
+        bases.push_back(w.base);
+    }
+
+    auto evTerm = evsignal_new(ws[0].base, SIGINT, onTerm, &bases);
+    VERIFY(evTerm);
+    event_add(evTerm, NULL);
+
+    timeval start, end;
+    evutil_gettimeofday(&start, NULL);
+    for (size_t i = 1; i < ws.size(); ++i)
+        threads.emplace_back(event_base_dispatch, ws[i].base);
+    event_base_dispatch(ws[0].base);
+    for (auto &t : threads) t.join();
+    evutil_gettimeofday(&end, NULL);
+
+    std::vector<uint32_t> latencies;
+    size_t bytes = 0, errors = 0;
+    for (auto &w : ws) {
+        for (auto &c : w.clients) {
+            if (c.conn) evhttp_connection_free(c.conn);
+        }
+        latencies.insert(latencies.end(), w.latencies.begin(), w.latencies.end());
+        bytes += w.bytes;
+        errors += w.errors;
+    }
+    event_free(evTerm);
+    for (auto &w : ws) event_base_free(w.base);
+    std::sort(latencies.begin(), latencies.end());
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("threads %d conns %d%s%s: %.0f req/s, %.1f MB/s, %zu requests, %zu errors\n",
+        o.threads, o.conns, o.close ? " close" : "", viaProxy ? " via proxy" : "",
+        latencies.size() / secs, bytes / secs / (1 << 20), latencies.size(), errors);
+    if (!latencies.empty())
+        printf("latency us: p50 %.0f, p99 %.0f, p999 %.0f, max %u\n",
+            percentile(latencies, 0.5), percentile(latencies, 0.99),
+            percentile(latencies, 0.999), latencies.back());
+
+    if (proxy) evhttp_uri_free(proxy);
+    evhttp_uri_free(location);
+    return 0;
+}
+
+static void
+usage(char *argv)
+{
+    fprintf(stderr, "Usage:\n"
+        "%s [-t threads] [-c conns] [-d seconds] [-k] [-x proxy-url] <url>\n"
+        " -t        - event loop threads, each with its own event_base\n"
+        "             (default 1)\n"
+        " -c        - connections, spread over the threads; each one keeps\n"
+        "             a single GET in flight on a keep-alive connection\n"
+        "             (default 1)\n"
+        " -d        - run time in seconds (default 5)\n"
+        " -k        - close the connection after every response instead\n"
+        " -x        - tunnel every connection through this HTTP proxy\n"
+        "             with CONNECT, e.g. http://127.0.0.1:3128\n", argv);
+    exit(EXIT_FAILURE);
+}
+
+static options
+getOpt(int argc, char **argv)
+{
+    int opt;
+    options o;
+    while ((opt = getopt(argc, argv, "t:c:d:kx:")) != -1) {
+        switch (opt) {
+            case 't': o.threads = atoi(optarg); break;
+            case 'c': o.conns = atoi(optarg); break;
+            case 'd': o.seconds = atoi(optarg); break;
+            case 'k': o.close = 1; break;
+            case 'x': o.proxy = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || o.threads < 1 || o.conns < o.threads || o.seconds < 1)
+        usage(argv[0]);
+    o.url = argv[optind];
+    return o;
+}
+
+static evhttp_uri *
+uriParse(const char *strUri)
+{
+    evhttp_uri *uri;
+
+    VERIFY(uri = evhttp_uri_parse(strUri));
+    VERIFY(evhttp_uri_get_host(uri));
+    if (evhttp_uri_get_port(uri) < 0) evhttp_uri_set_port(uri, 80);
+
+    return uri;
+}
+
+static void
+startClient(client *c)
+{
+    VERIFY(c->conn = evhttp_connection_base_new(c->w->base, NULL, connHost.c_str(), connPort));
+    if (!viaProxy) {
+        sendGet(c);
+        return;
+    }
+
+    evhttp_request *req;
+    VERIFY(req = evhttp_request_new(onConnect, c));
+    auto headers = evhttp_request_get_output_headers(req);
+    evhttp_add_header(headers, "Host", hostAndPort.c_str());
+    evhttp_add_header(headers, "Proxy-Connection", "keep-alive");
+    clock_gettime(CLOCK_MONOTONIC, &c->start);
+    VERIFY(!evhttp_make_request(c->conn, req, EVHTTP_REQ_CONNECT, hostAndPort.c_str()));
+}
+
+/* A new connection, once the callback that found the old one dead is done with it. */
+static void
+restartClient(evutil_socket_t fd, short event, void *arg)
+{
+    (void)fd;
+    (void)event;
+    client *c = static_cast<client*>(arg);
+    evhttp_connection_free(c->conn);
+    startClient(c);
+}
+
+static void
+sendGet(client *c)
+{
+    evhttp_request *req;
+    VERIFY(req = evhttp_request_new(onResponse, c));
+    auto headers = evhttp_request_get_output_headers(req);
+    evhttp_add_header(headers, "Host", hostAndPort.c_str());
+    evhttp_add_header(headers, "Connection", c->w->close ? "close" : "keep-alive");
+    clock_gettime(CLOCK_MONOTONIC, &c->start);
+    VERIFY(!evhttp_make_request(c->conn, req, EVHTTP_REQ_GET, path.c_str()));
+}
+
+static void
+onConnect(evhttp_request *req, void *arg)
+{
+    client *c = static_cast<client*>(arg);
+    if (!req || evhttp_request_get_response_code(req) / 100 != 2) {
+        failClient(c);
+        return;
+    }
+    sendGet(c);
+}
+
+static void
+onResponse(evhttp_request *req, void *arg)
+{
+    client *c = static_cast<client*>(arg);
+    auto w = c->w;
+    timespec end;
+
+    if (!req || !evhttp_request_get_response_code(req)) {
+        failClient(c);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    w->latencies.push_back((end.tv_sec - c->start.tv_sec) * 1000000 +
+        (end.tv_nsec - c->start.tv_nsec) / 1000);
+    w->bytes += evbuffer_get_length(evhttp_request_get_input_buffer(req));
+    if (evhttp_request_get_response_code(req) >= 400) ++w->errors;
+
+    // evhttp reconnects a closed direct connection by itself, a tunnel
+    // has to be opened again
+    if (w->close && viaProxy) {
+        event_base_once(w->base, -1, EV_TIMEOUT, restartClient, c, NULL);
+        return;
+    }
+    sendGet(c);
+}
+
+/* Count the failure and back off a little, so a dead server is not hammered. */
+static void
+failClient(client *c)
+{
+    timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+    ++c->w->errors;
+    event_base_once(c->w->base, -1, EV_TIMEOUT, restartClient, c, &tv);
+}
+
+/* Nearest rank of q in sorted. */
+static double
+percentile(const std::vector<uint32_t> &sorted, double q)
+{
+    size_t rank = q * sorted.size();
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+static void
+onTerm(evutil_socket_t sig, short what, void *arg)
+{
+    (void)what;
+    auto bases = (std::vector<event_base*>*)arg;
+    fprintf(stderr, "Got %i, Terminating...\n", (int)sig);
+    for (auto b : *bases) event_base_loopbreak(b);
+}
@@ -1,13 +1,32 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cstdarg>
+#include <climits>
 #include <cassert>
+#include <cctype>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <signal.h>
@@ -18,61 +37,720 @@
 #include <event2/http.h>
 #include <event2/listener.h>
 #include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/util.h>
 #include <event2/keyvalq_struct.h>
 #include <event2/thread.h>
 
+#include <zlib.h>
+
 
 char uriRoot[512];
 
-static const struct tableEntry{
+/*
+ * Built-in MIME types, indexed at compile time by contentTypeIdx; a
+ * mime.types file given with -m is consulted first.
+ */
+static constexpr struct tableEntry{
 		const char *extension;
 		const char *contentType;
 } contentTypeTbl[] = {
+		{ "html", "text/html" },
+		{ "htm", "text/html" },
+		{ "shtml", "text/html" },
+		{ "css", "text/css" },
+		{ "xml", "text/xml" },
 		{ "txt", "text/plain" },
+		{ "text", "text/plain" },
+		{ "log", "text/plain" },
+		{ "conf", "text/plain" },
+		{ "ini", "text/plain" },
 		{ "c", "text/plain" },
 		{ "h", "text/plain" },
-		{ "html", "text/html" },
-		{ "htm", "text/htm" },
-		{ "css", "text/css" },
+		{ "cc", "text/plain" },
+		{ "cpp", "text/plain" },
+		{ "cxx", "text/plain" },
+		{ "hpp", "text/plain" },
+		{ "hh", "text/plain" },
+		{ "hxx", "text/plain" },
+		{ "py", "text/plain" },
+		{ "rb", "text/plain" },
+		{ "pl", "text/plain" },
+		{ "sh", "text/plain" },
+		{ "go", "text/plain" },
+		{ "rs", "text/plain" },
+		{ "java", "text/plain" },
+		{ "md", "text/plain" },
+		{ "rst", "text/plain" },
+		{ "diff", "text/plain" },
+		{ "patch", "text/plain" },
+		{ "csv", "text/csv" },
+		{ "tsv", "text/tab-separated-values" },
+		{ "markdown", "text/markdown" },
+		{ "ics", "text/calendar" },
+		{ "vcf", "text/vcard" },
+		{ "vtt", "text/vtt" },
+		{ "htc", "text/x-component" },
+		{ "mml", "text/mathml" },
+		{ "jad", "text/vnd.sun.j2me.app-descriptor" },
+		{ "wml", "text/vnd.wap.wml" },
+		{ "yaml", "text/yaml" },
+		{ "yml", "text/yaml" },
 		{ "gif", "image/gif" },
+		{ "jpeg", "image/jpeg" },
 		{ "jpg", "image/jpeg" },
+		{ "jpe", "image/jpeg" },
+		{ "jfif", "image/jpeg" },
 		{ "png", "image/png" },
+		{ "apng", "image/apng" },
+		{ "avif", "image/avif" },
+		{ "webp", "image/webp" },
+		{ "bmp", "image/bmp" },
+		{ "svg", "image/svg+xml" },
+		{ "svgz", "image/svg+xml" },
+		{ "tif", "image/tiff" },
+		{ "tiff", "image/tiff" },
+		{ "ico", "image/x-icon" },
+		{ "jng", "image/x-jng" },
+		{ "wbmp", "image/vnd.wap.wbmp" },
+		{ "heic", "image/heic" },
+		{ "heif", "image/heif" },
+		{ "jxl", "image/jxl" },
+		{ "pnm", "image/x-portable-anymap" },
+		{ "pbm", "image/x-portable-bitmap" },
+		{ "pgm", "image/x-portable-graymap" },
+		{ "ppm", "image/x-portable-pixmap" },
+		{ "xbm", "image/x-xbitmap" },
+		{ "xpm", "image/x-xpixmap" },
+		{ "psd", "image/vnd.adobe.photoshop" },
+		{ "tga", "image/x-tga" },
+		{ "woff", "font/woff" },
+		{ "woff2", "font/woff2" },
+		{ "ttf", "font/ttf" },
+		{ "otf", "font/otf" },
+		{ "ttc", "font/collection" },
+		{ "eot", "application/vnd.ms-fontobject" },
+		{ "js", "application/javascript" },
+		{ "mjs", "application/javascript" },
+		{ "json", "application/json" },
+		{ "map", "application/json" },
+		{ "jsonld", "application/ld+json" },
+		{ "webmanifest", "application/manifest+json" },
+		{ "xhtml", "application/xhtml+xml" },
+		{ "xht", "application/xhtml+xml" },
+		{ "rss", "application/rss+xml" },
+		{ "atom", "application/atom+xml" },
+		{ "rdf", "application/rdf+xml" },
+		{ "xsl", "application/xslt+xml" },
+		{ "xslt", "application/xslt+xml" },
+		{ "wasm", "application/wasm" },
 		{ "pdf", "application/pdf" },
-		{ "ps", "application/postcript" },
-		{ NULL, NULL},
+		{ "ps", "application/postscript" },
+		{ "eps", "application/postscript" },
+		{ "ai", "application/postscript" },
+		{ "rtf", "application/rtf" },
+		{ "jar", "application/java-archive" },
+		{ "war", "application/java-archive" },
+		{ "ear", "application/java-archive" },
+		{ "class", "application/java-vm" },
+		{ "hqx", "application/mac-binhex40" },
+		{ "doc", "application/msword" },
+		{ "dot", "application/msword" },
+		{ "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+		{ "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+		{ "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+		{ "xls", "application/vnd.ms-excel" },
+		{ "xlt", "application/vnd.ms-excel" },
+		{ "ppt", "application/vnd.ms-powerpoint" },
+		{ "pps", "application/vnd.ms-powerpoint" },
+		{ "odt", "application/vnd.oasis.opendocument.text" },
+		{ "ods", "application/vnd.oasis.opendocument.spreadsheet" },
+		{ "odp", "application/vnd.oasis.opendocument.presentation" },
+		{ "odg", "application/vnd.oasis.opendocument.graphics" },
+		{ "m3u8", "application/vnd.apple.mpegurl" },
+		{ "kml", "application/vnd.google-earth.kml+xml" },
+		{ "kmz", "application/vnd.google-earth.kmz" },
+		{ "apk", "application/vnd.android.package-archive" },
+		{ "deb", "application/vnd.debian.binary-package" },
+		{ "rpm", "application/x-rpm" },
+		{ "wmlc", "application/vnd.wap.wmlc" },
+		{ "epub", "application/epub+zip" },
+		{ "zip", "application/zip" },
+		{ "gz", "application/gzip" },
+		{ "tgz", "application/gzip" },
+		{ "bz2", "application/x-bzip2" },
+		{ "tbz2", "application/x-bzip2" },
+		{ "xz", "application/x-xz" },
+		{ "txz", "application/x-xz" },
+		{ "zst", "application/zstd" },
+		{ "lz", "application/x-lzip" },
+		{ "lzma", "application/x-lzma" },
+		{ "7z", "application/x-7z-compressed" },
+		{ "rar", "application/x-rar-compressed" },
+		{ "tar", "application/x-tar" },
+		{ "cpio", "application/x-cpio" },
+		{ "shar", "application/x-shar" },
+		{ "iso", "application/x-iso9660-image" },
+		{ "dmg", "application/x-apple-diskimage" },
+		{ "exe", "application/x-msdownload" },
+		{ "dll", "application/x-msdownload" },
+		{ "msi", "application/x-msdownload" },
+		{ "so", "application/x-sharedlib" },
+		{ "o", "application/x-object" },
+		{ "a", "application/x-archive" },
+		{ "cco", "application/x-cocoa" },
+		{ "jardiff", "application/x-java-archive-diff" },
+		{ "jnlp", "application/x-java-jnlp-file" },
+		{ "run", "application/x-makeself" },
+		{ "pm", "application/x-perl" },
+		{ "prc", "application/x-pilot" },
+		{ "pdb", "application/x-pilot" },
+		{ "sea", "application/x-sea" },
+		{ "swf", "application/x-shockwave-flash" },
+		{ "sit", "application/x-stuffit" },
+		{ "tcl", "application/x-tcl" },
+		{ "tk", "application/x-tcl" },
+		{ "der", "application/x-x509-ca-cert" },
+		{ "pem", "application/x-x509-ca-cert" },
+		{ "crt", "application/x-x509-ca-cert" },
+		{ "cer", "application/x-x509-ca-cert" },
+		{ "p10", "application/pkcs10" },
+		{ "p7m", "application/pkcs7-mime" },
+		{ "p7c", "application/pkcs7-mime" },
+		{ "p7s", "application/pkcs7-signature" },
+		{ "p8", "application/pkcs8" },
+		{ "p12", "application/pkcs12" },
+		{ "pfx", "application/pkcs12" },
+		{ "crl", "application/pkix-crl" },
+		{ "sig", "application/pgp-signature" },
+		{ "asc", "application/pgp-signature" },
+		{ "xpi", "application/x-xpinstall" },
+		{ "torrent", "application/x-bittorrent" },
+		{ "sqlite", "application/x-sqlite3" },
+		{ "db", "application/x-sqlite3" },
+		{ "h5", "application/x-hdf5" },
+		{ "hdf5", "application/x-hdf5" },
+		{ "nc", "application/x-netcdf" },
+		{ "cdf", "application/x-netcdf" },
+		{ "latex", "application/x-latex" },
+		{ "tex", "application/x-tex" },
+		{ "texi", "application/x-texinfo" },
+		{ "texinfo", "application/x-texinfo" },
+		{ "t", "application/x-troff" },
+		{ "tr", "application/x-troff" },
+		{ "roff", "application/x-troff" },
+		{ "man", "application/x-troff-man" },
+		{ "dvi", "application/x-dvi" },
+		{ "ipynb", "application/x-ipynb+json" },
+		{ "toml", "application/toml" },
+		{ "sql", "application/sql" },
+		{ "graphql", "application/graphql" },
+		{ "bin", "application/octet-stream" },
+		{ "img", "application/octet-stream" },
+		{ "cab", "application/vnd.ms-cab-compressed" },
+		{ "vsd", "application/vnd.visio" },
+		{ "sqlite3", "application/vnd.sqlite3" },
+		{ "bz", "application/x-bzip" },
+		{ "gtar", "application/x-gtar" },
+		{ "crx", "application/x-chrome-extension" },
+		{ "bdf", "application/x-font-bdf" },
+		{ "pcf", "application/x-font-pcf" },
+		{ "lnk", "application/x-ms-shortcut" },
+		{ "parquet", "application/x-parquet" },
+		{ "pb", "application/x-protobuf" },
+		{ "proto", "application/x-protobuf" },
+		{ "msgpack", "application/x-msgpack" },
+		{ "cbor", "application/cbor" },
+		{ "mid", "audio/midi" },
+		{ "midi", "audio/midi" },
+		{ "kar", "audio/midi" },
+		{ "mp3", "audio/mpeg" },
+		{ "ogg", "audio/ogg" },
+		{ "oga", "audio/ogg" },
+		{ "opus", "audio/ogg" },
+		{ "m4a", "audio/x-m4a" },
+		{ "aac", "audio/aac" },
+		{ "flac", "audio/flac" },
+		{ "wav", "audio/wav" },
+		{ "weba", "audio/webm" },
+		{ "ra", "audio/x-realaudio" },
+		{ "aif", "audio/x-aiff" },
+		{ "aiff", "audio/x-aiff" },
+		{ "aifc", "audio/x-aiff" },
+		{ "mka", "audio/x-matroska" },
+		{ "amr", "audio/amr" },
+		{ "au", "audio/basic" },
+		{ "snd", "audio/basic" },
+		{ "3gpp", "video/3gpp" },
+		{ "3gp", "video/3gpp" },
+		{ "3g2", "video/3gpp2" },
+		{ "ts", "video/mp2t" },
+		{ "mp4", "video/mp4" },
+		{ "m4v", "video/mp4" },
+		{ "mpeg", "video/mpeg" },
+		{ "mpg", "video/mpeg" },
+		{ "mpe", "video/mpeg" },
+		{ "ogv", "video/ogg" },
+		{ "mov", "video/quicktime" },
+		{ "qt", "video/quicktime" },
+		{ "webm", "video/webm" },
+		{ "flv", "video/x-flv" },
+		{ "mkv", "video/x-matroska" },
+		{ "mk3d", "video/x-matroska" },
+		{ "mng", "video/x-mng" },
+		{ "asx", "video/x-ms-asf" },
+		{ "asf", "video/x-ms-asf" },
+		{ "wmv", "video/x-ms-wmv" },
+		{ "avi", "video/x-msvideo" },
+		{ "movie", "video/x-sgi-movie" },
+		{ "gltf", "model/gltf+json" },
+		{ "glb", "model/gltf-binary" },
+		{ "obj", "model/obj" },
+		{ "stl", "model/stl" },
+		{ "wrl", "model/vrml" },
+		{ "vrml", "model/vrml" },
+		{ "eml", "message/rfc822" },
+		{ "mht", "message/rfc822" },
+		{ "mhtml", "message/rfc822" },
 };
 
+#define MIME_BUCKETS  1024
+#define MAX_EXTENSION 15
+#define MAX_PROBES    8
+
+/* FNV-1a over the lower-cased extension. */
+static constexpr uint32_t 
+extensionHash(const char *ext, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        auto ch = ext[i];
+        if (ch >= 'A' && ch <= 'Z') ch += 'a' - 'A';
+        h = (h ^ (unsigned char)ch) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Open-addressed index of contentTypeTbl, slots hold index + 1. The table
+ * is kept at most half full and no lookup probes more than MAX_PROBES
+ * slots, both checked by the compiler.
+ */
+static constexpr auto contentTypeIdx = [] {
+    std::array<uint16_t, MIME_BUCKETS> idx{};
+    for (size_t i = 0; i < std::size(contentTypeTbl); ++i) {
+        auto ext = contentTypeTbl[i].extension;
+        auto h = extensionHash(ext, std::char_traits<char>::length(ext));
+        for (int probe = 0; ; ++probe, ++h) {
+            if (probe == MAX_PROBES) throw "contentTypeTbl: too many collisions";
+            if (!idx[h & (MIME_BUCKETS - 1)]) break;
+        }
+        idx[h & (MIME_BUCKETS - 1)] = i + 1;
+    }
+    return idx;
+}();
+
+static_assert(std::size(contentTypeTbl) * 2 <= MIME_BUCKETS, "grow MIME_BUCKETS");
+
+// extension -> type from -m, filled before any server starts, read-only after
+static std::unordered_map<std::string, std::string> mimeTypes;
+
 #define UNKNOWN_CONTENT_TYPE "application/misc"
+#define SMALL_FILE (64*1024)
+// gzipped on the loop itself, without -a; bigger files wait for an I/O thread
+#define INLINE_GZIP (16*1024)
+#define MAX_RANGES 16
+#define HTTP_DATE  "%a, %d %b %Y %H:%M:%S GMT"
+#define MAX_GZIP   (4*1024*1024)
+#define MAX_HEAD   (64*1024)
+#define DUMP_CHUNK (256*1024)
+#define DUMP_QUEUE (4*1024*1024)
+#define LOG_SLOTS  2048
+#define LOG_LINE   510
+#define LAT_SUB_BITS 2
+#define LAT_BUCKETS  (27 << LAT_SUB_BITS)
+#define MIN_GZIP   256
+#define FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+#define DIR_EVENTS  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+        IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Content codings, in order of preference. */
+enum {
+    ENC_ZSTD,
+    ENC_GZIP,
+    ENC_MAX
+};
+
+static const struct {
+    const char *name;
+    const char *suffix;
+} encodings[ENC_MAX] = {
+    { "zstd", ".zst" },
+    { "gzip", ".gz" },
+};
+
+/* -l: what goes to the access log. */
+enum {
+    LOG_NONE,
+    LOG_ACCESS,
+    LOG_DEBUG
+};
+
 struct options {
-		int port;
-		int iocp;
-		int verbose;
+		int port = 0;
+		int iocp = 0;
+		int verbose = 0;
+		int logLevel = LOG_ACCESS;
+		const char *accessLog = nullptr;
+		const char *dumpFile = nullptr;
+
+		int unlink = 0;
+		const char *unixSock = nullptr;
+		const char *docRoot = nullptr;
+
+		size_t cacheBytes = 64 << 20;
+		size_t cacheFiles = 1024;
+		size_t encBytes = 16 << 20;
+		size_t listBatch = 0;
+		const char *mimeFile = nullptr;
+		long benchLookups = 0;
+		int threads = 1;
+		int ioThreads = 0;
+
+		int timeout = 0;
+		int keepAlive = 15;
+		long maxConns = 0;
+		ssize_t maxBody = 0;
+		ssize_t maxHeaders = 0;
+};
+
+/*
+ * A cached GET target. Files up to SMALL_FILE and rendered directory
+ * listings are kept in memory and handed to replies by reference; larger
+ * files keep an open file segment that libevent sends with sendfile(2).
+ * Compressible files carry their encoded variants in enc[]: precompressed
+ * .zst/.gz siblings, or a gzip body made once when the entry was loaded.
+ * Replies still in flight hold a reference, so an evicted entry lives
+ * until its last reply is flushed.
+ */
+struct fileEntry {
+    std::string key;
+    std::string path;
+    const char *type = nullptr;
+    char       *data = nullptr;
+    evbuffer_file_segment *seg = nullptr;
+    off_t       size = 0;
+    off_t       fsize = 0;
+    dev_t       dev = 0;
+    ino_t       ino = 0;
+    timespec    mtime = {};
+    std::vector<int> wds;
+    int         refs = 1;
+    fileEntry  *enc[ENC_MAX] = {};
+    std::list<fileEntry*>::iterator lru;
+};
+
+struct byteRange {
+    off_t first;
+    off_t last;
+};
+
+struct fileCache {
+    std::unordered_map<std::string, fileEntry*> entries;
+    std::unordered_multimap<int, fileEntry*> watches;
+    std::list<fileEntry*> lru;
+    size_t  bytes = 0;
+    size_t  maxBytes = 0;
+    size_t  encBytes = 0;
+    size_t  maxEncBytes = 0;
+    size_t  maxFiles = 0;
+    int     notifyFd = -1;
+    event  *evNotify = nullptr;
+};
+
+struct server;
+
+struct dumpReader;
+struct dumpUpload;
+
+/*
+ * The blocking half of a GET that missed the cache. loadTarget() runs it
+ * inline or on an I/O thread, finishTarget() completes the reply on the
+ * request's own loop. With dump set, a chunk of a -D upload instead.
+ */
+struct ioJob {
+    server         *srv = nullptr;
+    evhttp_request *req = nullptr;
+    std::string     key;
+    std::string     uriPath;
+    std::string     path;
+    struct stat     st = {};
+    int             err = 0;
+    int             fd = -1;
+    DIR            *dir = nullptr;
+    evbuffer       *body = nullptr;
+    fileEntry      *ent = nullptr;
+    int             gzip = 0;       // ent still needs its gzip body, from gzipFd
+    int             gzipFd = -1;
+    dumpUpload     *dump = nullptr; // body goes to its file at offset
+    off_t           offset = 0;
+};
+
+struct ioPool {
+    std::mutex               lock;
+    std::condition_variable  ready;
+    std::deque<ioJob*>       jobs;
+    std::vector<std::thread> threads;
+    int                      stop = 0;
+} pool;
+
+struct listing;
+
+/*
+ * A client connection, tracked from its first request until evhttp
+ * closes it. busy counts requests whose replies are not finished yet.
+ */
+struct connState {
+    server            *srv = nullptr;
+    evhttp_connection *evcon = nullptr;
+    listing           *ls = nullptr;
+    dumpReader        *dr = nullptr;
+    int                busy = 0;
+    time_t             idleSince = 0;
+    timespec           start = {};
+    uint64_t           sent = 0;
+    uint64_t           sentAtStart = 0;
+};
+
+/*
+ * Counters of one serving thread. Only that thread writes them, with a
+ * relaxed load and store, so /metrics on any thread can sum them without
+ * locks or locked instructions. latency is log-linear in microseconds:
+ * 2^LAT_SUB_BITS buckets per power of two, see latencyBucket().
+ */
+struct metrics {
+    std::atomic<uint64_t> status[600] = {};
+    std::atomic<uint64_t> sentBytes{0};
+    std::atomic<uint64_t> shed{0};
+    std::atomic<uint64_t> cacheHits{0};
+    std::atomic<uint64_t> cacheMisses{0};
+    std::atomic<uint64_t> latency[LAT_BUCKETS] = {};
+    std::atomic<uint64_t> latencySumUs{0};
+    std::atomic<uint64_t> logDropped{0};
+};
+
+/*
+ * Log lines of one serving thread on their way to the log thread: a
+ * single producer, single consumer ring of fixed slots. A full ring drops
+ * the line rather than stall the loop.
+ */
+struct logSlot {
+    uint16_t len;
+    char     line[LOG_LINE];
+};
+
+struct logRing {
+    logSlot slots[LOG_SLOTS];
+    alignas(64) std::atomic<uint32_t> head{0};
+    alignas(64) std::atomic<uint32_t> tail{0};
+
+    time_t  stampSec = 0;
+    char    stamp[32] = "";
+};
+
+struct server {
+    options    *o = nullptr;
+    event_base *base = nullptr;
+    evhttp     *http = nullptr;
+    fileCache   cache;
+
+    std::mutex          doneLock;
+    std::deque<ioJob*>  done;
+    event              *evDone = nullptr;
+
+    std::unordered_map<evhttp_connection*, connState*> conns;
+    event              *evReap = nullptr;
+
+    // keyed by input buffer: evhttp gives no word of connections that
+    // close before their first request, evSweep finds those
+    std::unordered_map<evbuffer*, dumpReader*> readers;
+    event              *evSweep = nullptr;
+
+    metrics             stats;
+    logRing             log;
+};
+
+/*
+ * With -D every connection's input is screened as it is read, before
+ * evhttp parses it. Requests pass untouched, except a POST or PUT to
+ * /dump that has a Content-Length within -b: its body goes to a file of
+ * its own, <-D file>.<n>, written by the I/O threads as it arrives.
+ * evhttp only gets the head once the body is on disk, with
+ * Content-Length 0, the byte count in X-Dump-Length and the file in
+ * X-Dump-File, or X-Dump-Error if it could not be written.
+ */
+enum {
+    READ_HEAD,
+    READ_PASS,
+    READ_DUMP,
+    READ_FLUSH,
+    READ_RAW
+};
+
+struct dumpReader {
+    server       *srv = nullptr;
+    connState    *cs = nullptr;         // once evhttp took a request from it
+    bufferevent  *bev = nullptr;
+    evbuffer_cb_entry *cb = nullptr;
+    int           state = READ_HEAD;
+    int           busy = 0;
+    int           paused = 0;           // DUMP_QUEUE bytes wait for the disk
+    int           sendContinue = 0;     // once the replies before are out
+    int           unanswered = 0;       // heads passed on, replies not done
+    ev_int64_t    left = 0;
+    evbuffer     *raw = nullptr;
+    evbuffer     *head = nullptr;
+    dumpUpload   *upload = nullptr;
+    evbuffer     *chunk = nullptr;      // body not yet handed to the pool
+};
+
+/* An upload's file. The reader and every chunk in the pool hold a reference. */
+struct dumpUpload {
+    int           fd = -1;
+    int           refs = 1;
+    int           err = 0;
+    ev_int64_t    length = 0;
+    off_t         offset = 0;           // of the next chunk
+    size_t        queued = 0;           // bytes in the pool
+    dumpReader   *dr = nullptr;
+    std::string   path;
+};
+
+// numbers the -D files over all serving threads
+static std::atomic<unsigned> dumpSeq;
+
+struct logWriter {
+    int                 fd = STDOUT_FILENO;
+    std::vector<logRing*> rings;
+    std::thread         thread;
+    std::atomic<int>    stop{0};
+} logger;
+
+// every serving instance, for /metrics
+static std::vector<server> *servers;
+
+// tracked connections over all serving threads, checked against -C
+static std::atomic<long> connections;
 
-		int unlink;
-		const char *unixSock;
-		const char *docRoot;
+struct listing {
+    server         *srv = nullptr;
+    connState      *conn = nullptr;
+    evhttp_request *req = nullptr;
+    DIR            *dir = nullptr;
+    std::string     key;
+    std::string     path;
+    struct stat     st = {};
+    evbuffer       *html = nullptr;
 };
 
 
 static const char *guessContentType(const char *);
+static const char *linearContentType(const char *);
+static int loadMimeTypes(const char *);
+static void benchLookups(long);
 static void onRequest(evhttp_request *, void *);
 static void onSend(evhttp_request *, void *);
+static void onDump(evhttp_request *, void *);
+static connState *admitRequest(server *, evhttp_request *);
+static void onRequestDone(evhttp_request *, void *);
+static void onConnClose(evhttp_connection *, void *);
+static void onReap(evutil_socket_t, short, void *);
+static void onSent(evbuffer *, const evbuffer_cb_info *, void *);
+static void onMetrics(evhttp_request *, void *);
+static void bump(std::atomic<uint64_t> &, uint64_t = 1);
+static int latencyBucket(uint64_t);
+static const char *methodName(evhttp_cmd_type);
+static bufferevent *newDumpBev(event_base *, void *);
+static void onDumpInput(evbuffer *, const evbuffer_cb_info *, void *);
+static int dumpHead(dumpReader *, evbuffer *, size_t, evbuffer *);
+static void dumpProcess(dumpReader *, evbuffer *);
+static void dumpQueue(dumpReader *, size_t);
+static void dumpSubmit(dumpReader *);
+static void dumpFlush(dumpReader *, evbuffer *);
+static void dumpContinue(dumpReader *);
+static void dumpWrite(ioJob *);
+static void dumpDone(ioJob *);
+static void dumpUnref(dumpUpload *);
+static void freeDumpReader(server *, evbuffer *);
+static void onSweepReaders(evutil_socket_t, short, void *);
+static void logLine(server *, const char *, ...) __attribute__((format(printf, 2, 3)));
+static void logBuffer(server *, evbuffer *);
+static void logAccess(server *, evhttp_request *, int, uint64_t, uint64_t);
+static const char *logStamp(server *);
+static int logStart(std::vector<server> &, const char *);
+static void logStop();
+static void runLog();
+static void writeAll(int, iovec *, int);
+static uint64_t latencyBound(int);
 static void onTerm(int, short, void *);
 static void usage(FILE *, const char *, int);
 static options parseOpts(int, char **);
 static int displayDetail(evhttp_bound_socket*);
+static void serverInit(server *, options *);
+static void serverFree(server *);
+static void loadTarget(ioJob *, int);
+static fileEntry *loadBody(int, const struct stat &);
+static int loadEncodings(fileEntry *, const char *, const struct stat &);
+static void gzipEntry(ioJob *);
+static char *gzipBody(const char *, size_t, size_t *);
+static int isCompressible(const char *);
+static double acceptQuality(const char *, const char *);
+static void finishTarget(ioJob *);
+static void freeJob(ioJob *);
+static void poolStart(int);
+static void poolStop();
+static void poolSubmit(ioJob *);
+static void runPool();
+static void onIoDone(evutil_socket_t, short, void *);
+static void listingHead(evbuffer *, const char *, const char *);
+static size_t listingEntries(evbuffer *, DIR *, size_t);
+static void listingTail(evbuffer *);
+static void cacheListing(fileCache *, evbuffer *, const char *, const char *,
+        const struct stat &);
+static void startListing(server *, evhttp_request *, DIR *, const char *,
+        const char *, const char *, const struct stat &);
+static void onListingChunk(evhttp_connection *, void *);
+static void onListingClose(listing *);
+static void freeListing(listing *);
+static void cacheInit(fileCache *, event_base *, size_t, size_t, size_t);
+static void cacheClear(fileCache *);
+static fileEntry *cacheLookup(fileCache *, const char *);
+static fileEntry *cacheStore(fileCache *, fileEntry *, const char *, const char *,
+        const char *, const struct stat &, uint32_t);
+static int sameFile(const fileEntry *, const struct stat &);
+static int cacheWatch(fileCache *, fileEntry *, const char *, uint32_t);
+static size_t encodedBytes(const fileEntry *);
+static void cacheUnwatch(fileCache *, fileEntry *);
+static void cacheEvict(fileCache *, fileEntry *);
+static void cacheServe(fileEntry *, evbuffer *, off_t, off_t);
+static void replyFile(evhttp_request *, fileEntry *);
+static int notModified(evkeyvalq *, const char *, time_t);
+static int parseRanges(const char *, off_t, byteRange *, int);
+static void entryUnref(fileEntry *);
+static void onEntryDone(const void *, size_t, void *);
+static void onCacheNotify(evutil_socket_t, short, void *);
 
 int 
 main(int argc, char **argv)
 {
-    event_config    *cfg    = nullptr;
-    event_base      *base   = nullptr;
-    evhttp          *http   = nullptr;
     evhttp_bound_socket *handle = nullptr;
     evconnlistener  *lstner = nullptr;
     event           *evTerm = nullptr;
+    evutil_socket_t fd      = -1;
     int ret                 = 0;
+    int ioThreads           = 0;
+    std::vector<server>      srvs;
+    std::vector<std::thread> threads;
 
     auto o = parseOpts(argc, argv);
 
@@ -84,22 +762,41 @@ main(int argc, char **argv)
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
 
-    if (o.verbose || getenv("EVENT_DEBUG_LOGGING_ALL"))
-        event_enable_debug_logging(EVENT_DBG_ALL);
+    if (o.mimeFile && loadMimeTypes(o.mimeFile) < 0) {
+        perror(o.mimeFile);
+        ret = 1;
+        goto err;
+    }
 
-    cfg = event_config_new();
-    assert(cfg);
+    if (o.benchLookups) {
+        benchLookups(o.benchLookups);
+        goto err;
+    }
 
-    base = event_base_new_with_config(cfg);
-    assert(base);
+    if (o.maxConns) {
+        // every connection needs a descriptor, plus the cache's and the pool's
+        rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)o.maxConns + 256) {
+            rl.rlim_cur = std::min(rl.rlim_max, (rlim_t)o.maxConns + 256);
+            if (setrlimit(RLIMIT_NOFILE, &rl) < 0) perror("setrlimit");
+        }
+    }
 
-    event_config_free(cfg);
+    if (o.verbose || getenv("EVENT_DEBUG_LOGGING_ALL"))
+        event_enable_debug_logging(EVENT_DBG_ALL);
 
-    http = evhttp_new(base);
-    assert(http);
+    // without -a one I/O thread still does the on-the-fly gzip and -D writes
+    ioThreads = o.ioThreads ? o.ioThreads : ((o.encBytes && o.cacheFiles) || o.dumpFile);
+    if ((o.threads > 1 || ioThreads) && evthread_use_pthreads() < 0) {
+        fprintf(stderr, "evthread_use_pthreads failed\n");
+        ret = 1;
+        goto err;
+    }
 
-    evhttp_set_cb(http, "/dump", onRequest, NULL);
-    evhttp_set_gencb(http, onSend, &o);
+    srvs = std::vector<server>(o.threads);
+    servers = &srvs;
+    for (auto &srv : srvs)
+        serverInit(&srv, &o);
 
     if (o.unixSock) {
         sockaddr_un addr;
@@ -113,53 +810,238 @@ main(int argc, char **argv)
         addr.sun_family = AF_UNIX;
         strcpy(addr.sun_path, o.unixSock);
 
-        lstner = evconnlistener_new_bind(base, NULL, NULL, LEV_OPT_CLOSE_ON_FREE,
+        lstner = evconnlistener_new_bind(srvs[0].base, NULL, NULL, LEV_OPT_CLOSE_ON_FREE,
                 -1, (sockaddr*)&addr, sizeof(addr));
         assert(lstner);
 
-        handle = evhttp_bind_listener(http, lstner);
+        handle = evhttp_bind_listener(srvs[0].http, lstner);
         assert(handle);
 
     } else {
-        handle = evhttp_bind_socket_with_handle(http, "0.0.0.0", o.port);
+        handle = evhttp_bind_socket_with_handle(srvs[0].http, "0.0.0.0", o.port);
         assert(handle);
 
     };
 
     assert(!displayDetail(handle));
 
-    evTerm = evsignal_new(base, SIGINT, onTerm, base);
+    // every other evhttp accepts on its own duplicate of the bound socket
+    fd = evhttp_bound_socket_get_fd(handle);
+    for (size_t i = 1; i < srvs.size(); ++i) {
+        auto dupFd = dup(fd);
+        if (dupFd < 0 || !evhttp_accept_socket_with_handle(srvs[i].http, dupFd)) {
+            perror("evhttp_accept_socket_with_handle");
+            if (dupFd >= 0) close(dupFd);
+            ret = 1;
+            goto err;
+        }
+    }
+
+    evTerm = evsignal_new(srvs[0].base, SIGINT, onTerm, &srvs);
     assert(evTerm);
+    event_add(evTerm, NULL);
+
+    if (o.logLevel > LOG_NONE && logStart(srvs, o.accessLog) < 0) {
+        perror(o.accessLog);
+        ret = 1;
+        goto err;
+    }
+
+    poolStart(ioThreads);
+    for (size_t i = 1; i < srvs.size(); ++i)
+        threads.emplace_back(event_base_dispatch, srvs[i].base);
 
-    event_base_dispatch(base);
+    event_base_dispatch(srvs[0].base);
 
 err:
-    if (cfg) event_config_free(cfg);
-    if (http) evhttp_free(http);
+    for (auto &t : threads) t.join();
+    poolStop();
     if (evTerm) event_free(evTerm);
-    if (base) event_base_free(base);
+    for (auto &srv : srvs) serverFree(&srv);
+    logStop();
 
     return ret;
 }
 
+static void 
+serverInit(server *srv, options *o)
+{
+    auto cfg = event_config_new();
+    assert(cfg);
+
+    srv->o = o;
+    srv->base = event_base_new_with_config(cfg);
+    assert(srv->base);
+
+    event_config_free(cfg);
+
+    srv->http = evhttp_new(srv->base);
+    assert(srv->http);
+
+    cacheInit(&srv->cache, srv->base, o->cacheBytes, o->cacheFiles, o->encBytes);
+
+    if (o->ioThreads || (o->encBytes && o->cacheFiles) || o->dumpFile) {
+        srv->evDone = event_new(srv->base, -1, 0, onIoDone, srv);
+        assert(srv->evDone);
+    }
+
+    if (o->timeout) {
+        timeval tv = { o->timeout, 0 };
+        evhttp_set_timeout_tv(srv->http, &tv);
+    }
+    if (o->maxBody) evhttp_set_max_body_size(srv->http, o->maxBody);
+    if (o->maxHeaders) evhttp_set_max_headers_size(srv->http, o->maxHeaders);
+
+    if (o->keepAlive || o->maxConns) {
+        timeval tv = { 1, 0 };
+        srv->evReap = event_new(srv->base, -1, EV_PERSIST, onReap, srv);
+        assert(srv->evReap);
+        event_add(srv->evReap, &tv);
+    }
+
+    if (o->dumpFile) {
+        timeval tv = { 1, 0 };
+        srv->evSweep = event_new(srv->base, -1, EV_PERSIST, onSweepReaders, srv);
+        assert(srv->evSweep);
+        event_add(srv->evSweep, &tv);
+        evhttp_set_bevcb(srv->http, newDumpBev, srv);
+    }
+    evhttp_set_cb(srv->http, "/dump", onDump, srv);
+    evhttp_set_cb(srv->http, "/metrics", onMetrics, srv);
+    evhttp_set_gencb(srv->http, onSend, srv);
+}
+
+static void 
+serverFree(server *srv)
+{
+    // replies still waiting for their I/O are dropped with their connections
+    for (auto j : srv->done) freeJob(j);
+    srv->done.clear();
+    if (srv->evDone) event_free(srv->evDone);
+    srv->evDone = nullptr;
+    if (srv->evReap) event_free(srv->evReap);
+    srv->evReap = nullptr;
+    if (srv->evSweep) event_free(srv->evSweep);
+    srv->evSweep = nullptr;
+    // evhttp_free closes every connection, onConnClose drops its state
+    if (srv->http) evhttp_free(srv->http);
+    while (!srv->readers.empty()) freeDumpReader(srv, srv->readers.begin()->first);
+    cacheClear(&srv->cache);
+    if (srv->base) event_base_free(srv->base);
+    srv->http = nullptr;
+    srv->base = nullptr;
+}
+
 
 
 static const char *
 guessContentType(const char *path)
 {
+    auto lastPeriod = strrchr(path, '.');
+    if (!lastPeriod || strchr(lastPeriod, '/')) return UNKNOWN_CONTENT_TYPE;
+
+    auto ext = lastPeriod + 1;
+    auto len = strlen(ext);
+    if (!len || len > MAX_EXTENSION) return UNKNOWN_CONTENT_TYPE;
+
+    if (!mimeTypes.empty()) {
+        char lower[MAX_EXTENSION + 1];
+        for (size_t i = 0; i <= len; ++i) lower[i] = tolower((unsigned char)ext[i]);
+        auto it = mimeTypes.find(lower);
+        if (it != mimeTypes.end()) return it->second.c_str();
+    }
+
+    auto h = extensionHash(ext, len);
+    for (int probe = 0; probe < MAX_PROBES; ++probe, ++h) {
+        auto slot = contentTypeIdx[h & (MIME_BUCKETS - 1)];
+        if (!slot) break;
+        auto &entry = contentTypeTbl[slot - 1];
+        if (!evutil_ascii_strcasecmp(entry.extension, ext)) return entry.contentType;
+    }
+
+    return UNKNOWN_CONTENT_TYPE;
+}
+
+/* The scan guessContentType replaced, kept for benchLookups. */
+static const char *
+linearContentType(const char *path)
+{
+    auto lastPeriod = strrchr(path, '.');
+    if (!lastPeriod || strchr(lastPeriod, '/')) return UNKNOWN_CONTENT_TYPE;
+
+    for (auto &entry : contentTypeTbl) {
+        if (!evutil_ascii_strcasecmp(entry.extension, lastPeriod + 1))
+            return entry.contentType;
+    }
+    return UNKNOWN_CONTENT_TYPE;
+}
+
+/*
+ * Reads an Apache style mime.types ("type ext ext ...") into mimeTypes.
+ * nginx's "types { type ext ...; }" form is accepted as well.
+ */
+static int 
+loadMimeTypes(const char *file)
+{
+    auto fp = fopen(file, "r");
+    if (!fp) return -1;
 
-		auto lastPeriod = strchr(path, '.');
-		if (!lastPeriod || strchr(lastPeriod, '/')) {
-				return UNKNOWN_CONTENT_TYPE;
-		}
+    char *line = nullptr;
+    size_t cap = 0;
+    while (getline(&line, &cap, fp) != -1) {
+        auto hash = strchr(line, '#');
+        if (hash) *hash = '\0';
 
-		auto extension = lastPeriod + 1;
-		for (auto &entry : contentTypeTbl) {
-				if (!evutil_ascii_strcasecmp(entry.extension, extension)) 
-						return extension;
-		}
+        const char *type = nullptr;
+        char *save;
+        for (auto tok = strtok_r(line, " \t\r\n;{}", &save); tok;
+                tok = strtok_r(NULL, " \t\r\n;{}", &save)) {
+            if (!type) {
+                if (!strcmp(tok, "types")) continue;
+                type = tok;
+                continue;
+            }
+            if (strlen(tok) > MAX_EXTENSION) continue;
+            for (auto p = tok; *p; ++p) *p = tolower((unsigned char)*p);
+            mimeTypes[tok] = type;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+/* Times n lookups of every built-in extension and a few misses, both ways. */
+static void 
+benchLookups(long n)
+{
+    std::vector<std::string> paths;
+    for (auto &entry : contentTypeTbl)
+        paths.push_back(std::string("/static/assets/file.") + entry.extension);
+    for (auto miss : { "/README", "/a.b/Makefile", "/x.unknown", "/photo.JPG" })
+        paths.push_back(miss);
+
+    if (mimeTypes.empty()) {
+        for (auto &p : paths)
+            assert(!strcmp(guessContentType(p.c_str()), linearContentType(p.c_str())));
+    }
 
-		return UNKNOWN_CONTENT_TYPE;
+    struct {
+        const char *name;
+        const char *(*fn)(const char *);
+    } impls[] = {
+        { "linear", linearContentType },
+        { "hashed", guessContentType },
+    };
+    for (auto &impl : impls) {
+        size_t sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < n; ++i) {
+            for (auto &p : paths) sum += (size_t)impl.fn(p.c_str());
+        }
+        std::chrono::duration<double, std::nano> ns = std::chrono::steady_clock::now() - start;
+        printf("%-8s %8.1f ns/lookup (%zu)\n", impl.name, ns.count() / (n * paths.size()), sum & 0xff);
+    }
 }
 
 
@@ -167,139 +1049,1781 @@ guessContentType(const char *path)
 static void 
 onRequest(evhttp_request *req, void *arg)
 {
-    (void)arg;
-	const char *cmdType;
-	switch (evhttp_request_get_command(req)) {
-			case EVHTTP_REQ_GET: cmdType = "GET"; break;
-			case EVHTTP_REQ_POST: cmdType = "POST"; break;
-			case EVHTTP_REQ_HEAD: cmdType = "HEAD"; break;
-			case EVHTTP_REQ_PUT: cmdType = "PUT"; break;
-			case EVHTTP_REQ_DELETE: cmdType = "DELETE"; break;
-			case EVHTTP_REQ_OPTIONS: cmdType = "OPTIONS"; break;
-            case EVHTTP_REQ_TRACE: cmdType = "TRACE"; break;
-            case EVHTTP_REQ_CONNECT: cmdType = "CONNECT"; break;
-            case EVHTTP_REQ_PATCH: cmdType = "PATCH"; break;
-            default: cmdType = "unknown"; break;
+    server *srv = static_cast<server*>(arg);
+
+    if (srv->o->logLevel >= LOG_DEBUG) {
+        logLine(srv, "Received a %s request for %s\nHeaders:\n",
+                methodName(evhttp_request_get_command(req)), evhttp_request_get_uri(req));
+
+        auto headers = evhttp_request_get_input_headers(req);
+        for (auto header = headers->tqh_first; header; 
+                header = header->next.tqe_next) 
+            logLine(srv, "  %s: %s\n", header->key, header->value);
+
+        auto streamed = evhttp_find_header(headers, "X-Dump-Length");
+        if (streamed) {
+            logLine(srv, "Input data: %s bytes streamed to %s\n", streamed,
+                    evhttp_find_header(headers, "X-Dump-File"));
+        } else {
+            logLine(srv, "Input data: <<<\n");
+            logBuffer(srv, evhttp_request_get_input_buffer(req));
+            logLine(srv, ">>>\n");
+        }
+    }
+
+    evhttp_send_reply(req, 200, "OK", NULL);
+}
+
+static const char *
+methodName(evhttp_cmd_type cmd)
+{
+	switch (cmd) {
+			case EVHTTP_REQ_GET: return "GET";
+			case EVHTTP_REQ_POST: return "POST";
+			case EVHTTP_REQ_HEAD: return "HEAD";
+			case EVHTTP_REQ_PUT: return "PUT";
+			case EVHTTP_REQ_DELETE: return "DELETE";
+			case EVHTTP_REQ_OPTIONS: return "OPTIONS";
+            case EVHTTP_REQ_TRACE: return "TRACE";
+            case EVHTTP_REQ_CONNECT: return "CONNECT";
+            case EVHTTP_REQ_PATCH: return "PATCH";
+            default: return "unknown";
+    }
+}
+
+static bufferevent *
+newDumpBev(event_base *base, void *arg)
+{
+    server *srv = static_cast<server*>(arg);
+    // evhttp sets the fd once the connection is set up, and closes it
+    // itself on a bev without CLOSE_ON_FREE. Our reference outlives its
+    // bufferevent_free, which clears the callbacks evSweep looks at.
+    auto bev = bufferevent_socket_new(base, -1, 0);
+    if (!bev) return nullptr;
+    bufferevent_incref(bev);
+
+    auto input = bufferevent_get_input(bev);
+    auto dr = new dumpReader;
+    dr->srv = srv;
+    dr->bev = bev;
+    dr->raw = evbuffer_new();
+    dr->head = evbuffer_new();
+    dr->chunk = evbuffer_new();
+    dr->cb = evbuffer_add_cb(input, onDumpInput, dr);
+    srv->readers.emplace(input, dr);
+    return bev;
+}
+
+/*
+ * Runs as soon as a read lands in input, before evhttp's read callback.
+ * The new bytes are taken out again and handed back a request at a time:
+ * everything but /dump bodies moves by chain, with no copy. A head that
+ * never ends, or a body we cannot delimit, switches the connection to
+ * plain pass through and leaves it to evhttp.
+ */
+static void 
+onDumpInput(evbuffer *input, const evbuffer_cb_info *info, void *arg)
+{
+    dumpReader *dr = static_cast<dumpReader*>(arg);
+    if (!info->n_added || dr->busy) return;
+
+    // our own moves below call back in here
+    dr->busy = 1;
+    auto old = evbuffer_get_length(input) - info->n_added;
+    if (!old) {
+        evbuffer_add_buffer(dr->raw, input);
+    } else {
+        // evhttp has not consumed all it got before, that stays in front
+        auto keep = evbuffer_new();
+        evbuffer_remove_buffer(input, keep, old);
+        evbuffer_add_buffer(dr->raw, input);
+        evbuffer_add_buffer(input, keep);
+        evbuffer_free(keep);
     }
+    dumpProcess(dr, input);
+    dr->busy = 0;
+}
 
-    printf("Received a %s request for %s\nHeaders:\n", cmdType, evhttp_request_get_uri(req));
+/* Moves dr->raw on as far as it can go now; a finished upload waits for its writes. */
+static void 
+dumpProcess(dumpReader *dr, evbuffer *input)
+{
+    while (auto len = evbuffer_get_length(dr->raw)) {
+        if (dr->state == READ_FLUSH) {
+            break;
+        } else if (dr->state == READ_RAW) {
+            evbuffer_add_buffer(input, dr->raw);
+        } else if (dr->state == READ_PASS) {
+            auto n = (size_t)std::min<ev_int64_t>(dr->left, len);
+            evbuffer_remove_buffer(dr->raw, input, n);
+            dr->left -= n;
+            if (!dr->left) dr->state = READ_HEAD;
+        } else if (dr->state == READ_DUMP) {
+            auto n = (size_t)std::min<ev_int64_t>(dr->left, len);
+            dr->left -= n;
+            dumpQueue(dr, n);
+            if (!dr->left) {
+                dr->state = READ_FLUSH;
+                if (!dr->upload->queued) dumpFlush(dr, input);
+            }
+        } else {
+            auto end = evbuffer_search(dr->raw, "\r\n\r\n", 4, NULL);
+            if (end.pos < 0) {
+                if (len <= MAX_HEAD) break;
+                dr->state = READ_RAW;
+            } else if (dumpHead(dr, dr->raw, end.pos + 4, input) < 0) {
+                dr->state = READ_RAW;
+            }
+        }
+    }
+}
 
+/*
+ * Takes the head of headLen bytes off src. It goes straight to dst, or,
+ * for a /dump upload, is rewritten into dr->head to follow its body.
+ */
+static int 
+dumpHead(dumpReader *dr, evbuffer *src, size_t headLen, evbuffer *dst)
+{
+    auto head = (char*)evbuffer_pullup(src, headLen);
+    std::string line(head, (char*)memchr(head, '\n', headLen) - head + 1);
+    char method[16], target[1024];
 
-    auto headers = evhttp_request_get_input_headers(req);
-    for (auto &header = headers->tqh_first; header; 
-            header = header->next.tqe_next) 
-        printf("  %s: %s\n", header->key, header->value);
+    if (sscanf(line.c_str(), "%15s %1023s", method, target) != 2) return -1;
+    auto query = strchr(target, '?');
+    if (query) *query = '\0';
+    int upload = (!strcmp(method, "POST") || !strcmp(method, "PUT")) && !strcmp(target, "/dump");
 
-    auto buf = evhttp_request_get_input_buffer(req);
-    printf("Input data: <<<\n");
+    ev_int64_t length = 0;
+    int chunked = 0, expect = 0;
+    std::string rewritten = line;
+    for (size_t pos = line.size(); pos < headLen - 2; ) {
+        auto eol = (char*)memchr(head + pos, '\n', headLen - pos) - head + 1;
+        std::string field(head + pos, eol - pos);
+        pos = eol;
 
-    while (evbuffer_get_length(buf)) {
-        char data[128];
-        int n = evbuffer_remove(buf, data, sizeof(data));
-        if (n > 0)  fwrite(data, 1, n, stdout);
+        if (!evutil_ascii_strncasecmp(field.c_str(), "Content-Length:", 15)) {
+            length = strtoll(field.c_str() + 15, NULL, 10);
+            continue;
+        }
+        if (!evutil_ascii_strncasecmp(field.c_str(), "Transfer-Encoding:", 18)) chunked = 1;
+        if (!evutil_ascii_strncasecmp(field.c_str(), "Expect:", 7)) {
+            expect = 1;
+            continue;
+        }
+        if (!evutil_ascii_strncasecmp(field.c_str(), "X-Dump-", 7)) continue;
+        rewritten += field;
     }
+    if (chunked || length < 0) {
+        evbuffer_remove_buffer(src, dst, headLen);
+        return -1;
+    }
+    // evhttp never sees these bodies: -b is applied by passing the real
+    // Content-Length on, which evhttp answers with 413
+    auto maxBody = dr->srv->o->maxBody;
+    if (maxBody && length > maxBody) upload = 0;
 
-    printf(">>>\n");
+    if (!upload) {
+        evbuffer_remove_buffer(src, dst, headLen);
+        ++dr->unanswered;
+        dr->left = length;
+        dr->state = length ? READ_PASS : READ_HEAD;
+        return 0;
+    }
 
-    evhttp_send_reply(req, 200, "OK", NULL);
+    evbuffer_drain(src, headLen);
+    evbuffer_add(dr->head, rewritten.data(), rewritten.size());
+    auto up = new dumpUpload;
+    up->dr = dr;
+    up->length = length;
+    up->path = std::string(dr->srv->o->dumpFile) + "." + std::to_string(dumpSeq++);
+    up->fd = open(up->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (up->fd < 0) {
+        up->err = errno;
+        perror(up->path.c_str());
+    }
+    dr->upload = up;
+
+    // it would land in the middle of a reply still going out
+    if (expect && length) {
+        if (dr->unanswered) dr->sendContinue = 1;
+        else dumpContinue(dr);
+    }
+
+    dr->left = length;
+    dr->state = READ_DUMP;
+    if (!length) {
+        dr->state = READ_FLUSH;
+        dumpFlush(dr, dst);
+    }
+    return 0;
 }
 
+/* Moves the next n body bytes on to the pool, DUMP_CHUNK at a time. */
 static void 
-onSend(evhttp_request *req, void *arg)
+dumpQueue(dumpReader *dr, size_t n)
 {
-    options *o = static_cast<options*>(arg);
-    int fd;
-    char *wholePath = nullptr;
-    evbuffer *buf = nullptr;
-    size_t len = 0;
-    if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
-        onRequest(req, arg);
+    if (dr->upload->fd < 0) {
+        evbuffer_drain(dr->raw, n);
         return;
     }
-    auto uri = evhttp_request_get_uri(req);
-    printf("Got a GET request for .%s>\n", uri);
-    auto decode = evhttp_uri_parse(uri);
-    if (!decode) {
-        printf("It's not a good URI. Sending BADREQUEST\n");
-        evhttp_send_error(req, HTTP_BADREQUEST, 0);
-        return;
+    evbuffer_remove_buffer(dr->raw, dr->chunk, n);
+    if (evbuffer_get_length(dr->chunk) >= DUMP_CHUNK || !dr->left) dumpSubmit(dr);
+}
+
+static void 
+dumpSubmit(dumpReader *dr)
+{
+    auto up = dr->upload;
+    auto len = evbuffer_get_length(dr->chunk);
+    if (!len) return;
+
+    auto j = new ioJob;
+    j->srv = dr->srv;
+    j->dump = up;
+    j->offset = up->offset;
+    j->body = dr->chunk;
+    dr->chunk = evbuffer_new();
+    up->offset += len;
+    up->queued += len;
+    ++up->refs;
+    poolSubmit(j);
+
+    // a client faster than the disk waits
+    if (up->queued >= DUMP_QUEUE && !dr->paused) {
+        bufferevent_disable(dr->bev, EV_READ);
+        dr->paused = 1;
     }
-    auto path = evhttp_uri_get_path(decode);
-    if (!path) path = "/";
-    auto decodePath = evhttp_uridecode(path, 0, NULL);
-    if (decodePath == NULL) 
-        goto err;
-    if (strstr(decodePath, ".."))
-        goto err;
-    len = strlen(decodePath) + strlen(o->docRoot) + 2;
-    wholePath  =  new char[len];
-    if (!wholePath) {
-        perror("new");
-        goto err;
+}
+
+/* The body is on disk, or could not be written: its head goes on to evhttp. */
+static void 
+dumpFlush(dumpReader *dr, evbuffer *dst)
+{
+    auto up = dr->upload;
+    evbuffer_add_printf(dr->head, "Content-Length: 0\r\nX-Dump-Length: %lld\r\n",
+            (long long)up->length);
+    if (up->err)
+        evbuffer_add_printf(dr->head, "X-Dump-Error: %s\r\n", strerror(up->err));
+    else
+        evbuffer_add_printf(dr->head, "X-Dump-File: %s\r\n", up->path.c_str());
+    evbuffer_add(dr->head, "\r\n", 2);
+    evbuffer_add_buffer(dst, dr->head);
+    ++dr->unanswered;
+
+    up->dr = nullptr;
+    dr->upload = nullptr;
+    dumpUnref(up);
+    dr->sendContinue = 0;
+    dr->state = READ_HEAD;
+}
+
+/*
+ * Goes behind whatever the connection sent before. evhttp keeps writes
+ * off while it reads, and its write callback must not see these bytes,
+ * so they leave the output buffer right here; the bufferevent otherwise
+ * only lets its own writes drain it.
+ */
+static void 
+dumpContinue(dumpReader *dr)
+{
+    static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    auto out = bufferevent_get_output(dr->bev);
+
+    dr->sendContinue = 0;
+    evbuffer_add(out, cont, sizeof(cont) - 1);
+    evbuffer_unfreeze(out, 1);
+    evbuffer_write(out, bufferevent_getfd(dr->bev));
+    evbuffer_freeze(out, 1);
+}
+
+/* On an I/O thread. Chunks of an upload may be written in any order. */
+static void 
+dumpWrite(ioJob *j)
+{
+    int n = evbuffer_peek(j->body, -1, NULL, NULL, 0);
+    std::vector<evbuffer_iovec> vec(n);
+    evbuffer_peek(j->body, -1, NULL, vec.data(), n);
+    std::vector<iovec> iov(n);
+    for (int i = 0; i < n; ++i) {
+        iov[i].iov_base = vec[i].iov_base;
+        iov[i].iov_len = vec[i].iov_len;
     }
-    evutil_snprintf(wholePath, len, "%s/%s", o->docRoot, decodePath);
-    struct stat st;
-    if (stat(wholePath, &st) < 0 )
-        goto err;
-    buf = evbuffer_new();
-    if (S_ISDIR(st.st_mode)) {
-       const char *trailingSlash = "";
-       dirent *ent;
-       if (!strlen(path) || path[strlen(path)-1] != '/')
-           trailingSlash = "/";
-       auto d = opendir(wholePath);
-       if (!d)  
-           goto err;
-       evbuffer_add_printf(buf, 
-               "<!DOCTYPE html>\n"
-               "<html>\n <head>\n"
-               " <meta charset='utf-8'>\n"
-               "  <title>%s</title>\n"
-               "  <base href='%s%s'>\n"
-               "</head>\n"
-               "<body>\n"
-               "<h1>%s</h1>\n"
-               "<ul>\n",
-               decodePath, 
-               path, 
-               trailingSlash,
-               decodePath);
-       while ((ent = readdir(d))){
-           auto name = ent->d_name;
-           evbuffer_add_printf(buf,
-                   "    <li><a href=\"%s\">%s</a>\n",
-                   name, name);
-       }
-       evbuffer_add_printf(buf, "</url></body></html>\n");
-       closedir(d);
-       evhttp_add_header(evhttp_request_get_output_headers(req),
-               "Content-Type", "text/html");
-    } else {
-        auto type = guessContentType(decodePath);
-        fd = open(wholePath, O_RDONLY);
-        if (fd < 0) {
-            perror("open");
-            goto err;
+
+    auto offset = j->offset;
+    for (size_t i = 0; i < iov.size(); ) {
+        auto ret = pwritev(j->dump->fd, &iov[i], std::min<size_t>(iov.size() - i, IOV_MAX), offset);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            j->err = errno;
+            return;
         }
-        if (fstat(fd, &st) < 0) {
-            perror("fstat");
-            goto err;
+        offset += ret;
+        while (i < iov.size() && (size_t)ret >= iov[i].iov_len) {
+            ret -= iov[i].iov_len;
+            ++i;
+        }
+        if (i < iov.size()) {
+            iov[i].iov_base = (char*)iov[i].iov_base + ret;
+            iov[i].iov_len -= ret;
         }
-        evhttp_add_header(evhttp_request_get_output_headers(req),
-                "Content-Type", type);
-        evbuffer_add_file(buf, fd, 0, st.st_size);
     }
-    goto done;
-err:
-    evhttp_send_error(req, HTTP_NOTFOUND, NULL);
-    if (fd >= 0) close(fd);
-done:
-    if (decode) evhttp_uri_free(decode);
-    if (decodePath) delete[] decodePath;
-    if (wholePath) delete[] wholePath;
-    if (buf)    evbuffer_free(buf);
 }
 
+/* Back on the loop: reading goes on, and a finished upload's head goes to evhttp. */
+static void 
+dumpDone(ioJob *j)
+{
+    auto up = j->dump;
+    up->queued -= evbuffer_get_length(j->body);
+    if (j->err && !up->err) {
+        fprintf(stderr, "%s: %s\n", up->path.c_str(), strerror(j->err));
+        up->err = j->err;
+    }
+    auto dr = up->dr;
+    freeJob(j);
+    if (!dr) return;
+
+    if (dr->paused && up->queued < DUMP_QUEUE / 2) {
+        dr->paused = 0;
+        bufferevent_enable(dr->bev, EV_READ);
+    }
+    if (dr->state == READ_FLUSH && !up->queued) {
+        // the bufferevent only lets its own reads add to input
+        auto input = bufferevent_get_input(dr->bev);
+        evbuffer_unfreeze(input, 0);
+        dr->busy = 1;
+        dumpFlush(dr, input);
+        dumpProcess(dr, input);
+        dr->busy = 0;
+        evbuffer_freeze(input, 0);
+        // evhttp only looks at its input after a read
+        bufferevent_trigger(dr->bev, EV_READ, 0);
+    }
+}
+
+static void 
+dumpUnref(dumpUpload *up)
+{
+    if (--up->refs) return;
+    if (up->fd >= 0) close(up->fd);
+    delete up;
+}
+
+static void 
+freeDumpReader(server *srv, evbuffer *input)
+{
+    auto it = srv->readers.find(input);
+    if (it == srv->readers.end()) return;
+
+    auto dr = it->second;
+    srv->readers.erase(it);
+    evbuffer_remove_cb_entry(input, dr->cb);
+    bufferevent_decref(dr->bev);
+    if (dr->cs) dr->cs->dr = nullptr;
+    // chunks already in the pool still get written
+    if (dr->upload) {
+        dr->upload->dr = nullptr;
+        dumpUnref(dr->upload);
+    }
+    evbuffer_free(dr->raw);
+    evbuffer_free(dr->head);
+    evbuffer_free(dr->chunk);
+    delete dr;
+}
+
+/* Frees the readers of connections evhttp has let go without a closecb. */
+static void 
+onSweepReaders(evutil_socket_t fd, short what, void *arg)
+{
+    (void)fd; (void)what;
+    server *srv = static_cast<server*>(arg);
+    std::vector<evbuffer*> gone;
+
+    for (auto &[input, dr] : srv->readers) {
+        bufferevent_event_cb eventcb;
+        bufferevent_getcb(dr->bev, NULL, NULL, &eventcb, NULL);
+        if (!eventcb) gone.push_back(input);
+    }
+    for (auto input : gone) freeDumpReader(srv, input);
+}
+
+/* Prometheus text exposition of every serving thread's counters, summed. */
+static void 
+onMetrics(evhttp_request *req, void *arg)
+{
+    if (!admitRequest(static_cast<server*>(arg), req)) return;
+
+    uint64_t status[600] = {}, latency[LAT_BUCKETS] = {};
+    uint64_t sentBytes = 0, shed = 0, hits = 0, misses = 0, sumUs = 0, dropped = 0;
+    for (auto &srv : *servers) {
+        auto &st = srv.stats;
+        for (int i = 0; i < 600; ++i) status[i] += st.status[i].load(std::memory_order_relaxed);
+        for (int i = 0; i < LAT_BUCKETS; ++i)
+            latency[i] += st.latency[i].load(std::memory_order_relaxed);
+        sentBytes += st.sentBytes.load(std::memory_order_relaxed);
+        shed += st.shed.load(std::memory_order_relaxed);
+        hits += st.cacheHits.load(std::memory_order_relaxed);
+        misses += st.cacheMisses.load(std::memory_order_relaxed);
+        sumUs += st.latencySumUs.load(std::memory_order_relaxed);
+        dropped += st.logDropped.load(std::memory_order_relaxed);
+    }
+
+    auto buf = evbuffer_new();
+    evbuffer_add_printf(buf,
+            "# HELP httpsrv_requests_total Replies flushed, by status code.\n"
+            "# TYPE httpsrv_requests_total counter\n");
+    for (int i = 100; i < 600; ++i) {
+        if (status[i])
+            evbuffer_add_printf(buf, "httpsrv_requests_total{code=\"%d\"} %llu\n", i,
+                    (unsigned long long)status[i]);
+    }
+    evbuffer_add_printf(buf,
+            "# HELP httpsrv_sent_bytes_total Bytes written to client sockets.\n"
+            "# TYPE httpsrv_sent_bytes_total counter\n"
+            "httpsrv_sent_bytes_total %llu\n"
+            "# HELP httpsrv_connections Open client connections.\n"
+            "# TYPE httpsrv_connections gauge\n"
+            "httpsrv_connections %ld\n"
+            "# HELP httpsrv_shed_total Connections refused with a 503 at the -C limit.\n"
+            "# TYPE httpsrv_shed_total counter\n"
+            "httpsrv_shed_total %llu\n"
+            "# HELP httpsrv_cache_hits_total GET targets served from the cache.\n"
+            "# TYPE httpsrv_cache_hits_total counter\n"
+            "httpsrv_cache_hits_total %llu\n"
+            "# HELP httpsrv_cache_misses_total GET targets looked up on disk.\n"
+            "# TYPE httpsrv_cache_misses_total counter\n"
+            "httpsrv_cache_misses_total %llu\n"
+            "# HELP httpsrv_cache_hit_ratio Share of GET targets served from the cache.\n"
+            "# TYPE httpsrv_cache_hit_ratio gauge\n"
+            "httpsrv_cache_hit_ratio %g\n"
+            "# HELP httpsrv_log_dropped_total Log lines dropped on a full ring.\n"
+            "# TYPE httpsrv_log_dropped_total counter\n"
+            "httpsrv_log_dropped_total %llu\n",
+            (unsigned long long)sentBytes, connections.load(std::memory_order_relaxed),
+            (unsigned long long)shed, (unsigned long long)hits, (unsigned long long)misses,
+            hits + misses ? (double)hits / (hits + misses) : 0.0, (unsigned long long)dropped);
+
+    uint64_t count = 0;
+    evbuffer_add_printf(buf,
+            "# HELP httpsrv_request_duration_seconds From dispatch to reply flushed.\n"
+            "# TYPE httpsrv_request_duration_seconds histogram\n");
+    for (int i = 0; i < LAT_BUCKETS - 1; ++i) {
+        count += latency[i];
+        evbuffer_add_printf(buf, "httpsrv_request_duration_seconds_bucket{le=\"%g\"} %llu\n",
+                latencyBound(i) / 1e6, (unsigned long long)count);
+    }
+    count += latency[LAT_BUCKETS - 1];
+    evbuffer_add_printf(buf,
+            "httpsrv_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+            "httpsrv_request_duration_seconds_sum %g\n"
+            "httpsrv_request_duration_seconds_count %llu\n",
+            (unsigned long long)count, sumUs / 1e6, (unsigned long long)count);
+
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+            "text/plain; version=0.0.4");
+    evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    evbuffer_free(buf);
+}
+
+/* Single writer per counter: no locked read-modify-write needed. */
+static void 
+bump(std::atomic<uint64_t> &counter, uint64_t n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/*
+ * Values below 2^LAT_SUB_BITS get a bucket each, above that every power
+ * of two is split in 2^LAT_SUB_BITS; the last bucket takes the overflow.
+ */
+static int 
+latencyBucket(uint64_t us)
+{
+    if (us < (1 << LAT_SUB_BITS)) return us;
+    int exp = 63 - __builtin_clzll(us);
+    int sub = (us >> (exp - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1);
+    return std::min(((exp - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + sub, LAT_BUCKETS - 1);
+}
+
+/* Exclusive upper bound of bucket b in microseconds. */
+static uint64_t 
+latencyBound(int b)
+{
+    if (b < (1 << LAT_SUB_BITS)) return b + 1;
+    int exp = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    int sub = b & ((1 << LAT_SUB_BITS) - 1);
+    return (uint64_t)((1 << LAT_SUB_BITS) + sub + 1) << (exp - LAT_SUB_BITS);
+}
+
+static void 
+logLine(server *srv, const char *fmt, ...)
+{
+    auto r = &srv->log;
+    auto head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) == LOG_SLOTS) {
+        bump(srv->stats.logDropped);
+        return;
+    }
+
+    auto slot = &r->slots[head & (LOG_SLOTS - 1)];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(slot->line, sizeof(slot->line), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (n >= (int)sizeof(slot->line)) {
+        n = sizeof(slot->line) - 1;
+        slot->line[n - 1] = '\n';
+    }
+    slot->len = n;
+    r->head.store(head + 1, std::memory_order_release);
+}
+
+/* Copies buf into the log a slot at a time, leaving buf as it is. */
+static void 
+logBuffer(server *srv, evbuffer *buf)
+{
+    evbuffer_ptr pos;
+    evbuffer_iovec vec;
+
+    evbuffer_ptr_set(buf, &pos, 0, EVBUFFER_PTR_SET);
+    while (evbuffer_peek(buf, -1, &pos, &vec, 1) > 0) {
+        for (size_t off = 0; off < vec.iov_len; off += LOG_LINE - 1) {
+            int n = std::min(vec.iov_len - off, (size_t)LOG_LINE - 1);
+            logLine(srv, "%.*s", n, (char*)vec.iov_base + off);
+        }
+        if (evbuffer_ptr_set(buf, &pos, vec.iov_len, EVBUFFER_PTR_ADD) < 0) break;
+    }
+}
+
+/* One logfmt line per reply. */
+static void 
+logAccess(server *srv, evhttp_request *req, int code, uint64_t bytes, uint64_t us)
+{
+    auto evcon = evhttp_request_get_connection(req);
+    const char *addr = "-";
+    ev_uint16_t port = 0;
+
+    if (evcon) evhttp_connection_get_peer(evcon, (char**)&addr, &port);
+    logLine(srv, "ts=%s client=%s:%u method=%s uri=\"%s\" status=%d bytes=%llu us=%llu\n",
+            logStamp(srv), addr, port, methodName(evhttp_request_get_command(req)),
+            evhttp_request_get_uri(req), code, (unsigned long long)bytes,
+            (unsigned long long)us);
+}
+
+/* The loop's cached time, formatted once a second. */
+static const char *
+logStamp(server *srv)
+{
+    auto r = &srv->log;
+    timeval now;
+    tm gmt;
+
+    event_base_gettimeofday_cached(srv->base, &now);
+    if (now.tv_sec != r->stampSec) {
+        r->stampSec = now.tv_sec;
+        gmtime_r(&now.tv_sec, &gmt);
+        strftime(r->stamp, sizeof(r->stamp), "%Y-%m-%dT%H:%M:%SZ", &gmt);
+    }
+    return r->stamp;
+}
+
+static int 
+logStart(std::vector<server> &srvs, const char *path)
+{
+    if (path) {
+        logger.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (logger.fd < 0) return -1;
+    }
+    for (auto &srv : srvs) logger.rings.push_back(&srv.log);
+    logger.thread = std::thread(runLog);
+    return 0;
+}
+
+/* Called once the serving threads are gone; the log thread drains what is left. */
+static void 
+logStop()
+{
+    if (!logger.thread.joinable()) return;
+    logger.stop.store(1, std::memory_order_release);
+    logger.thread.join();
+    if (logger.fd != STDOUT_FILENO) close(logger.fd);
+}
+
+/*
+ * Gathers whatever the rings hold into one writev per batch. An idle
+ * pass sleeps a little instead of having producers signal every line.
+ */
+static void 
+runLog()
+{
+    iovec iov[IOV_MAX];
+
+    for (;;) {
+        int stop = logger.stop.load(std::memory_order_acquire);
+        size_t lines = 0;
+
+        for (auto r : logger.rings) {
+            auto tail = r->tail.load(std::memory_order_relaxed);
+            auto head = r->head.load(std::memory_order_acquire);
+            while (tail != head) {
+                int n = 0;
+                auto end = tail;
+                for (; end != head && n < IOV_MAX; ++end, ++n) {
+                    auto slot = &r->slots[end & (LOG_SLOTS - 1)];
+                    iov[n].iov_base = slot->line;
+                    iov[n].iov_len = slot->len;
+                }
+                writeAll(logger.fd, iov, n);
+                lines += n;
+                tail = end;
+                r->tail.store(tail, std::memory_order_release);
+            }
+        }
+
+        if (!lines) {
+            if (stop) break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+}
+
+/* writev that finishes short writes and gives up on errors. */
+static void 
+writeAll(int fd, iovec *iov, int n)
+{
+    while (n > 0) {
+        auto ret = writev(fd, iov, n);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            perror("writev");
+            return;
+        }
+        while (n > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
+
+static void 
+onDump(evhttp_request *req, void *arg)
+{
+    if (!admitRequest(static_cast<server*>(arg), req)) return;
+    if (evhttp_find_header(evhttp_request_get_input_headers(req), "X-Dump-Error")) {
+        evhttp_send_error(req, HTTP_INTERNAL, NULL);
+        return;
+    }
+    onRequest(req, arg);
+}
+
+/*
+ * Tracks the request's connection. A connection that shows up while -C
+ * connections are open is answered with a 503 and closed instead; those
+ * already admitted keep being served.
+ */
+static connState *
+admitRequest(server *srv, evhttp_request *req)
+{
+    auto evcon = evhttp_request_get_connection(req);
+    connState *cs;
+
+    auto it = srv->conns.find(evcon);
+    if (it != srv->conns.end()) {
+        cs = it->second;
+    } else {
+        if (srv->o->maxConns && connections.load(std::memory_order_relaxed) >= srv->o->maxConns) {
+            auto out = evhttp_request_get_output_headers(req);
+            evhttp_add_header(out, "Connection", "close");
+            evhttp_add_header(out, "Retry-After", "1");
+            evhttp_send_reply(req, 503, "Service Unavailable", NULL);
+            bump(srv->stats.shed);
+            bump(srv->stats.status[503]);
+            if (srv->o->logLevel >= LOG_ACCESS) logAccess(srv, req, 503, 0, 0);
+            freeDumpReader(srv, bufferevent_get_input(evhttp_connection_get_bufferevent(evcon)));
+            return nullptr;
+        }
+        cs = new connState;
+        cs->srv = srv;
+        cs->evcon = evcon;
+        srv->conns.emplace(evcon, cs);
+        connections.fetch_add(1, std::memory_order_relaxed);
+        evhttp_connection_set_closecb(evcon, onConnClose, cs);
+        auto dr = srv->readers.find(bufferevent_get_input(evhttp_connection_get_bufferevent(evcon)));
+        if (dr != srv->readers.end()) {
+            cs->dr = dr->second;
+            dr->second->cs = cs;
+        }
+        evbuffer_add_cb(bufferevent_get_output(evhttp_connection_get_bufferevent(evcon)),
+                onSent, cs);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &cs->start);
+    cs->sentAtStart = cs->sent;
+    ++cs->busy;
+    evhttp_request_set_on_complete_cb(req, onRequestDone, cs);
+    return cs;
+}
+
+/* The reply has been flushed to the socket. */
+static void 
+onRequestDone(evhttp_request *req, void *arg)
+{
+    connState *cs = static_cast<connState*>(arg);
+    auto stats = &cs->srv->stats;
+    timeval now;
+    timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t us = (end.tv_sec - cs->start.tv_sec) * 1000000 +
+        (end.tv_nsec - cs->start.tv_nsec) / 1000;
+    bump(stats->latency[latencyBucket(us)]);
+    bump(stats->latencySumUs, us);
+    auto code = evhttp_request_get_response_code(req);
+    if (code >= 100 && code < 600) bump(stats->status[code]);
+    if (cs->srv->o->logLevel >= LOG_ACCESS)
+        logAccess(cs->srv, req, code, cs->sent - cs->sentAtStart, us);
+
+    event_base_gettimeofday_cached(cs->srv->base, &now);
+    if (!--cs->busy) cs->idleSince = now.tv_sec;
+    if (cs->dr && cs->dr->unanswered && !--cs->dr->unanswered && cs->dr->sendContinue)
+        dumpContinue(cs->dr);
+}
+
+static void 
+onSent(evbuffer *buf, const evbuffer_cb_info *info, void *arg)
+{
+    (void)buf;
+    connState *cs = static_cast<connState*>(arg);
+    if (info->n_deleted) {
+        cs->sent += info->n_deleted;
+        bump(cs->srv->stats.sentBytes, info->n_deleted);
+    }
+}
+
+static void 
+onConnClose(evhttp_connection *evcon, void *arg)
+{
+    connState *cs = static_cast<connState*>(arg);
+
+    if (cs->ls) onListingClose(cs->ls);
+    auto bev = evhttp_connection_get_bufferevent(evcon);
+    evbuffer_remove_cb(bufferevent_get_output(bev), onSent, cs);
+    freeDumpReader(cs->srv, bufferevent_get_input(bev));
+    cs->srv->conns.erase(evcon);
+    connections.fetch_sub(1, std::memory_order_relaxed);
+    delete cs;
+}
+
+/*
+ * Closes keep-alive connections idle for -k seconds, or every idle one
+ * while the server is at its -C limit so that new clients get a slot.
+ */
+static void 
+onReap(evutil_socket_t fd, short event, void *arg)
+{
+    (void)fd;
+    (void)event;
+    server *srv = static_cast<server*>(arg);
+    auto o = srv->o;
+    timeval now;
+    std::vector<evhttp_connection*> idle;
+
+    event_base_gettimeofday_cached(srv->base, &now);
+    auto full = o->maxConns && connections.load(std::memory_order_relaxed) >= o->maxConns;
+    for (auto &c : srv->conns) {
+        auto cs = c.second;
+        if (cs->busy) continue;
+        if (full || (o->keepAlive && now.tv_sec - cs->idleSince >= o->keepAlive))
+            idle.push_back(c.first);
+    }
+    for (auto evcon : idle)
+        evhttp_connection_free(evcon);
+}
+
+static void 
+onSend(evhttp_request *req, void *arg)
+{
+    server *srv = static_cast<server*>(arg);
+    options *o = srv->o;
+    char *wholePath = nullptr;
+    char *decodePath = nullptr;
+    evbuffer *buf = nullptr;
+    fileEntry *ent = nullptr;
+    ioJob *job = nullptr;
+    size_t len = 0;
+    if (!admitRequest(srv, req)) return;
+    if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+        onRequest(req, arg);
+        return;
+    }
+    auto uri = evhttp_request_get_uri(req);
+    if (o->logLevel >= LOG_DEBUG) logLine(srv, "Got a GET request for .%s>\n", uri);
+    auto decode = evhttp_uri_parse(uri);
+    if (!decode) {
+        if (o->logLevel >= LOG_DEBUG) logLine(srv, "It's not a good URI. Sending BADREQUEST\n");
+        evhttp_send_error(req, HTTP_BADREQUEST, 0);
+        return;
+    }
+    auto path = evhttp_uri_get_path(decode);
+    if (!path) path = "/";
+    decodePath = evhttp_uridecode(path, 0, NULL);
+    if (decodePath == NULL) 
+        goto err;
+    if (strstr(decodePath, ".."))
+        goto err;
+    if ((ent = cacheLookup(&srv->cache, decodePath))) {
+        bump(srv->stats.cacheHits);
+        replyFile(req, ent);
+        goto done;
+    }
+    bump(srv->stats.cacheMisses);
+    len = strlen(decodePath) + strlen(o->docRoot) + 2;
+    wholePath  =  new char[len];
+    if (!wholePath) {
+        perror("new");
+        goto err;
+    }
+    evutil_snprintf(wholePath, len, "%s/%s", o->docRoot, decodePath);
+
+    job = new ioJob;
+    job->srv = srv;
+    job->req = req;
+    job->key = decodePath;
+    job->uriPath = path;
+    job->path = wholePath;
+    if (o->ioThreads) {
+        poolSubmit(job);
+    } else {
+        loadTarget(job, o->listBatch != 0);
+        // compressing more would hold up every connection of this loop
+        if (job->gzip && job->st.st_size <= INLINE_GZIP) gzipEntry(job);
+        if (job->gzip) poolSubmit(job);
+        else finishTarget(job);
+    }
+    goto done;
+err:
+    evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+done:
+    if (decode) evhttp_uri_free(decode);
+    if (decodePath) free(decodePath);
+    if (wholePath) delete[] wholePath;
+    if (buf)    evbuffer_free(buf);
+}
+
+/*
+ * Everything a cache miss may block on: stat, open and read of small
+ * files, opendir and readdir. Runs on an I/O thread with -a, so it must
+ * not touch the loop or the cache; with stream set, a directory is only
+ * opened and left to startListing.
+ */
+static void 
+loadTarget(ioJob *j, int stream)
+{
+    const fileCache *c = &j->srv->cache;
+    auto path = j->path.c_str();
+
+    if (stat(path, &j->st) < 0) {
+        j->err = errno;
+        return;
+    }
+
+    if (S_ISDIR(j->st.st_mode)) {
+        auto d = opendir(path);
+        if (!d) {
+            j->err = errno;
+            return;
+        }
+        if (stream) {
+            j->dir = d;
+            return;
+        }
+        j->body = evbuffer_new();
+        listingHead(j->body, j->key.c_str(), j->uriPath.c_str());
+        listingEntries(j->body, d, SIZE_MAX);
+        listingTail(j->body);
+        closedir(d);
+        return;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &j->st) < 0) {
+        j->err = errno;
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    auto size = j->st.st_size;
+    j->fd = fd;
+    if (!S_ISREG(j->st.st_mode) || !c->maxFiles ||
+            (size <= SMALL_FILE && (size_t)size > c->maxBytes)) 
+        return;
+
+    // anything that fails below is still served from the plain fd
+    auto e = loadBody(fd, j->st);
+    if (!e) return;
+    j->fd = -1;
+    j->ent = e;
+
+    if (isCompressible(guessContentType(j->key.c_str())) && loadEncodings(e, path, j->st) &&
+            c->maxEncBytes) {
+        j->gzip = 1;
+        j->gzipFd = fd;
+    }
+}
+
+/* An in-memory or segment body for fd, which it takes over on success. */
+static fileEntry *
+loadBody(int fd, const struct stat &st)
+{
+    auto e = new fileEntry;
+    e->size = st.st_size;
+    if (e->size <= SMALL_FILE) {
+        e->data = (char*)malloc(e->size ? e->size : 1);
+        if (!e->data || pread(fd, e->data, e->size, 0) != e->size) {
+            entryUnref(e);
+            return nullptr;
+        }
+        close(fd);
+    } else {
+        e->seg = evbuffer_file_segment_new(fd, 0, e->size, EVBUF_FS_CLOSE_ON_FREE);
+        if (!e->seg) {
+            entryUnref(e);
+            return nullptr;
+        }
+    }
+    return e;
+}
+
+/*
+ * Picks up precompressed siblings that are not older than the file.
+ * Siblings are watched like the file once the entry is cached; a sibling
+ * that shows up later is only noticed when the file is reloaded. Returns 1
+ * if the file should be gzipped, which gzipEntry does on an I/O thread.
+ */
+static int 
+loadEncodings(fileEntry *e, const char *path, const struct stat &st)
+{
+    for (int i = 0; i < ENC_MAX; ++i) {
+        std::string sibling = std::string(path) + encodings[i].suffix;
+        struct stat sst;
+        int sfd = open(sibling.c_str(), O_RDONLY | O_CLOEXEC);
+        if (sfd < 0) continue;
+        if (fstat(sfd, &sst) < 0 || !S_ISREG(sst.st_mode) || sst.st_mtime < st.st_mtime ||
+                !(e->enc[i] = loadBody(sfd, sst))) {
+            close(sfd);
+            continue;
+        }
+        auto v = e->enc[i];
+        v->path = sibling;
+        v->fsize = sst.st_size;
+        v->dev = sst.st_dev;
+        v->ino = sst.st_ino;
+        v->mtime = sst.st_mtim;
+    }
+
+    return !e->enc[ENC_GZIP] && st.st_size >= MIN_GZIP && st.st_size <= MAX_GZIP;
+}
+
+/* Gzips j's file when the result fits the encoded-bytes budget. */
+static void 
+gzipEntry(ioJob *j)
+{
+    auto e = j->ent;
+    auto size = j->st.st_size;
+    j->gzip = 0;
+
+    char *plain = e->data;
+    if (!plain) {
+        plain = (char*)malloc(size);
+        if (!plain || pread(j->gzipFd, plain, size, 0) != size) {
+            free(plain);
+            return;
+        }
+    }
+
+    size_t len;
+    auto gz = gzipBody(plain, size, &len);
+    if (plain != e->data) free(plain);
+    if (!gz) return;
+    if (len > j->srv->cache.maxEncBytes) {
+        free(gz);
+        return;
+    }
+
+    auto v = new fileEntry;
+    v->data = gz;
+    v->size = len;
+    e->enc[ENC_GZIP] = v;
+}
+
+/* A gzip member of len bytes of data, or NULL if it would not be smaller. */
+static char *
+gzipBody(const char *data, size_t len, size_t *outLen)
+{
+    z_stream zs = {};
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return nullptr;
+
+    auto bound = deflateBound(&zs, len);
+    auto out = (char*)malloc(bound);
+    if (!out) {
+        deflateEnd(&zs);
+        return nullptr;
+    }
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = bound;
+    int ret = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+
+    if (ret != Z_STREAM_END || zs.total_out >= len) {
+        free(out);
+        return nullptr;
+    }
+    *outLen = zs.total_out;
+    return out;
+}
+
+static int 
+isCompressible(const char *type)
+{
+    static const char *types[] = {
+        "text/", "application/javascript", "application/json", "application/xml",
+        "application/postscript", "application/wasm", "image/svg+xml", "image/x-icon",
+    };
+    for (auto t : types) {
+        if (!strncmp(type, t, strlen(t))) return 1;
+    }
+    auto len = strlen(type);
+    return (len > 4 && !strcmp(type + len - 4, "+xml")) ||
+        (len > 5 && !strcmp(type + len - 5, "+json"));
+}
+
+/* The q value the client gives to coding name, 0 if not acceptable. */
+static double 
+acceptQuality(const char *header, const char *name)
+{
+    double any = 0;
+    std::string list(header);
+    size_t pos = 0;
+    while (pos < list.size()) {
+        auto end = list.find(',', pos);
+        if (end == std::string::npos) end = list.size();
+        auto token = list.substr(pos, end - pos);
+        pos = end + 1;
+
+        double q = 1;
+        auto semi = token.find(';');
+        if (semi != std::string::npos) {
+            auto qpos = token.find("q=", semi);
+            if (qpos != std::string::npos) q = atof(token.c_str() + qpos + 2);
+            token.erase(semi);
+        }
+        token.erase(0, token.find_first_not_of(" \t"));
+        token.erase(token.find_last_not_of(" \t") + 1);
+
+        if (!evutil_ascii_strcasecmp(token.c_str(), name)) return q;
+        if (token == "*") any = q;
+    }
+    return any;
+}
+
+/* Back on the request's loop: cache what loadTarget produced and reply. */
+static void 
+finishTarget(ioJob *j)
+{
+    auto srv = j->srv;
+    auto req = j->req;
+    auto headers = evhttp_request_get_output_headers(req);
+    auto key = j->key.c_str();
+    auto path = j->path.c_str();
+
+    if (j->err) {
+        evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+        freeJob(j);
+        return;
+    }
+
+    if (j->dir) {
+        evhttp_add_header(headers, "Content-Type", "text/html");
+        startListing(srv, req, j->dir, key, path, j->uriPath.c_str(), j->st);
+        j->dir = nullptr;
+        freeJob(j);
+        return;
+    }
+
+    if (j->body) {
+        evhttp_add_header(headers, "Content-Type", "text/html");
+        cacheListing(&srv->cache, j->body, key, path, j->st);
+        evhttp_send_reply(req, HTTP_OK, "OK", j->body);
+    } else if (j->ent) {
+        // keep our reference, the cache drops its own if it refuses the entry
+        auto e = j->ent;
+        ++e->refs;
+        cacheStore(&srv->cache, e, key, path, guessContentType(key), j->st, FILE_EVENTS);
+        replyFile(req, e);
+    } else {
+        // an uncached file is served through a transient entry
+        auto e = new fileEntry;
+        e->type = guessContentType(key);
+        e->fsize = j->st.st_size;
+        e->ino = j->st.st_ino;
+        e->mtime = j->st.st_mtim;
+        if (j->st.st_size > 0) {
+            e->seg = evbuffer_file_segment_new(j->fd, 0, j->st.st_size, EVBUF_FS_CLOSE_ON_FREE);
+            if (!e->seg) {
+                // not an empty 200 with the ETag of the real file
+                evhttp_send_error(req, HTTP_INTERNAL, NULL);
+                entryUnref(e);
+                freeJob(j);
+                return;
+            }
+            e->size = j->st.st_size;
+            j->fd = -1;
+        }
+        replyFile(req, e);
+        entryUnref(e);
+    }
+    freeJob(j);
+}
+
+/*
+ * Replies with e, honouring If-None-Match/If-Modified-Since and single or
+ * multiple byte ranges. The ETag and Last-Modified come from the stat the
+ * body was built from.
+ */
+static void 
+replyFile(evhttp_request *req, fileEntry *e)
+{
+    auto in = evhttp_request_get_input_headers(req);
+    auto out = evhttp_request_get_output_headers(req);
+    char etag[80], lastMod[64], line[128];
+    byteRange ranges[MAX_RANGES];
+    tm gmt;
+
+    // every encoding is its own representation with its own ETag
+    int enc = ENC_MAX;
+    int hasEnc = 0;
+    auto accept = evhttp_find_header(in, "Accept-Encoding");
+    for (int i = 0; i < ENC_MAX; ++i) {
+        if (!e->enc[i]) continue;
+        hasEnc = 1;
+        if (enc == ENC_MAX && accept && acceptQuality(accept, encodings[i].name) > 0)
+            enc = i;
+    }
+    auto body = enc < ENC_MAX ? e->enc[enc] : e;
+
+    evutil_snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx%s%s\"",
+            (unsigned long long)e->ino, (unsigned long long)e->fsize,
+            (unsigned long long)e->mtime.tv_sec * 1000000000ULL + e->mtime.tv_nsec,
+            enc < ENC_MAX ? "-" : "", enc < ENC_MAX ? encodings[enc].name : "");
+    gmtime_r(&e->mtime.tv_sec, &gmt);
+    strftime(lastMod, sizeof(lastMod), HTTP_DATE, &gmt);
+    if (hasEnc) evhttp_add_header(out, "Vary", "Accept-Encoding");
+    if (enc < ENC_MAX) evhttp_add_header(out, "Content-Encoding", encodings[enc].name);
+    evhttp_add_header(out, "ETag", etag);
+    evhttp_add_header(out, "Last-Modified", lastMod);
+    evhttp_add_header(out, "Accept-Ranges", "bytes");
+
+    if (notModified(in, etag, e->mtime.tv_sec)) {
+        evhttp_send_reply(req, HTTP_NOTMODIFIED, "Not Modified", NULL);
+        return;
+    }
+
+    int n = 0;
+    auto range = evhttp_find_header(in, "Range");
+    auto ifRange = evhttp_find_header(in, "If-Range");
+    if (range && (!ifRange || !strcmp(ifRange, etag) || !strcmp(ifRange, lastMod)))
+        n = parseRanges(range, body->size, ranges, MAX_RANGES);
+
+    if (n < 0) {
+        evutil_snprintf(line, sizeof(line), "bytes */%lld", (long long)body->size);
+        evhttp_add_header(out, "Content-Range", line);
+        evhttp_send_reply(req, 416, "Range Not Satisfiable", NULL);
+        return;
+    }
+
+    auto buf = evbuffer_new();
+    if (n == 0) {
+        evhttp_add_header(out, "Content-Type", e->type);
+        cacheServe(body, buf, 0, body->size);
+        evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    } else if (n == 1) {
+        evhttp_add_header(out, "Content-Type", e->type);
+        evutil_snprintf(line, sizeof(line), "bytes %lld-%lld/%lld", (long long)ranges[0].first,
+                (long long)ranges[0].last, (long long)body->size);
+        evhttp_add_header(out, "Content-Range", line);
+        cacheServe(body, buf, ranges[0].first, ranges[0].last - ranges[0].first + 1);
+        evhttp_send_reply(req, 206, "Partial Content", buf);
+    } else {
+        uint64_t boundary;
+        evutil_secure_rng_get_bytes(&boundary, sizeof(boundary));
+        evutil_snprintf(line, sizeof(line), "multipart/byteranges; boundary=%016llx",
+                (unsigned long long)boundary);
+        evhttp_add_header(out, "Content-Type", line);
+        for (int i = 0; i < n; ++i) {
+            evbuffer_add_printf(buf, "\r\n--%016llx\r\n"
+                    "Content-Type: %s\r\n"
+                    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    (unsigned long long)boundary, e->type, (long long)ranges[i].first,
+                    (long long)ranges[i].last, (long long)body->size);
+            cacheServe(body, buf, ranges[i].first, ranges[i].last - ranges[i].first + 1);
+        }
+        evbuffer_add_printf(buf, "\r\n--%016llx--\r\n", (unsigned long long)boundary);
+        evhttp_send_reply(req, 206, "Partial Content", buf);
+    }
+    evbuffer_free(buf);
+}
+
+/* If-None-Match wins over If-Modified-Since, as RFC 7232 asks. */
+static int 
+notModified(evkeyvalq *in, const char *etag, time_t mtime)
+{
+    auto inm = evhttp_find_header(in, "If-None-Match");
+    if (inm) {
+        std::string list(inm);
+        size_t pos = 0;
+        while (pos < list.size()) {
+            auto end = list.find(',', pos);
+            if (end == std::string::npos) end = list.size();
+            auto tag = list.substr(pos, end - pos);
+            pos = end + 1;
+
+            tag.erase(0, tag.find_first_not_of(" \t"));
+            tag.erase(tag.find_last_not_of(" \t") + 1);
+            if (!tag.compare(0, 2, "W/")) tag.erase(0, 2);
+            if (tag == "*" || tag == etag) return 1;
+        }
+        return 0;
+    }
+
+    auto ims = evhttp_find_header(in, "If-Modified-Since");
+    tm t = {};
+    if (ims && strptime(ims, HTTP_DATE, &t))
+        return mtime <= timegm(&t);
+    return 0;
+}
+
+/*
+ * Parses a "bytes=" Range header against a body of size bytes. Returns the
+ * number of satisfiable ranges, -1 if none is, or 0 if the header is to be
+ * ignored because it is malformed or asks for more than max ranges.
+ */
+static int 
+parseRanges(const char *h, off_t size, byteRange *ranges, int max)
+{
+    if (strncmp(h, "bytes=", 6)) return 0;
+
+    int n = 0;
+    auto p = h + 6;
+    for (;;) {
+        char *end;
+        long long first, last;
+
+        while (*p == ' ' || *p == '\t') ++p;
+        if (*p == '-') {
+            auto suffix = strtoll(p + 1, &end, 10);
+            if (end == p + 1 || suffix < 0) return 0;
+            first = size > suffix ? size - suffix : 0;
+            last = size - 1;
+            if (!suffix) first = size;
+        } else {
+            first = strtoll(p, &end, 10);
+            if (end == p || *end != '-' || first < 0) return 0;
+            p = end + 1;
+            last = strtoll(p, &end, 10);
+            if (end == p) last = size - 1;
+            else if (last < first) return 0;
+        }
+        p = end;
+
+        if (first < size) {
+            if (n == max) return 0;
+            ranges[n].first = first;
+            ranges[n].last = last < size ? last : size - 1;
+            ++n;
+        }
+
+        while (*p == ' ' || *p == '\t') ++p;
+        if (*p == ',') {
+            ++p;
+            continue;
+        }
+        if (*p) return 0;
+        break;
+    }
+
+    return n ? n : -1;
+}
+
+static void 
+freeJob(ioJob *j)
+{
+    if (j->ent) entryUnref(j->ent);
+    if (j->fd >= 0) close(j->fd);
+    if (j->dir) closedir(j->dir);
+    if (j->body) evbuffer_free(j->body);
+    if (j->dump) dumpUnref(j->dump);
+    delete j;
+}
+
+static void 
+poolStart(int n)
+{
+    for (int i = 0; i < n; ++i)
+        pool.threads.emplace_back(runPool);
+}
+
+static void 
+poolStop()
+{
+    {
+        std::lock_guard<std::mutex> l(pool.lock);
+        pool.stop = 1;
+    }
+    pool.ready.notify_all();
+    for (auto &t : pool.threads) t.join();
+    pool.threads.clear();
+    for (auto j : pool.jobs) freeJob(j);
+    pool.jobs.clear();
+}
+
+static void 
+poolSubmit(ioJob *j)
+{
+    {
+        std::lock_guard<std::mutex> l(pool.lock);
+        pool.jobs.push_back(j);
+    }
+    pool.ready.notify_one();
+}
+
+static void 
+runPool()
+{
+    for (;;) {
+        ioJob *j;
+        {
+            std::unique_lock<std::mutex> l(pool.lock);
+            pool.ready.wait(l, [] { return pool.stop || !pool.jobs.empty(); });
+            if (pool.stop) return;
+            j = pool.jobs.front();
+            pool.jobs.pop_front();
+        }
+
+        if (j->dump) {
+            dumpWrite(j);
+        } else {
+            if (!j->gzip) loadTarget(j, 0);
+            if (j->gzip) gzipEntry(j);
+        }
+
+        auto srv = j->srv;
+        {
+            std::lock_guard<std::mutex> l(srv->doneLock);
+            srv->done.push_back(j);
+        }
+        event_active(srv->evDone, EV_READ, 0);
+    }
+}
+
+static void 
+onIoDone(evutil_socket_t fd, short what, void *arg)
+{
+    (void)fd;
+    (void)what;
+    server *srv = static_cast<server*>(arg);
+    std::deque<ioJob*> done;
+    {
+        std::lock_guard<std::mutex> l(srv->doneLock);
+        done.swap(srv->done);
+    }
+    for (auto j : done) {
+        if (j->dump) dumpDone(j);
+        else finishTarget(j);
+    }
+}
+
+
+static void 
+listingHead(evbuffer *buf, const char *decodePath, const char *path)
+{
+    const char *trailingSlash = "";
+    if (!strlen(path) || path[strlen(path)-1] != '/')
+        trailingSlash = "/";
+    evbuffer_add_printf(buf, 
+            "<!DOCTYPE html>\n"
+            "<html>\n <head>\n"
+            " <meta charset='utf-8'>\n"
+            "  <title>%s</title>\n"
+            "  <base href='%s%s'>\n"
+            "</head>\n"
+            "<body>\n"
+            "<h1>%s</h1>\n"
+            "<ul>\n",
+            decodePath, 
+            path, 
+            trailingSlash,
+            decodePath);
+}
+
+/* Renders up to max entries of d, returns how many were read. */
+static size_t 
+listingEntries(evbuffer *buf, DIR *d, size_t max)
+{
+    dirent *ent;
+    size_t n = 0;
+    while (n < max && (ent = readdir(d))) {
+        auto name = ent->d_name;
+        evbuffer_add_printf(buf,
+                "    <li><a href=\"%s\">%s</a>\n",
+                name, name);
+        ++n;
+    }
+    return n;
+}
+
+static void 
+listingTail(evbuffer *buf)
+{
+    evbuffer_add_printf(buf, "</ul></body></html>\n");
+}
+
+/* Keeps a copy of a fully rendered listing until the directory changes. */
+static void 
+cacheListing(fileCache *c, evbuffer *html, const char *key, const char *path,
+        const struct stat &st)
+{
+    size_t len = evbuffer_get_length(html);
+    if (!c->maxFiles || len > c->maxBytes) return;
+
+    auto e = new fileEntry;
+    e->size = len;
+    e->data = (char*)malloc(len);
+    if (!e->data) {
+        entryUnref(e);
+        return;
+    }
+    evbuffer_copyout(html, e->data, len);
+    cacheStore(c, e, key, path, "text/html", st, DIR_EVENTS);
+}
+
+/*
+ * Streamed listing: the directory is read listBatch entries at a time and
+ * every batch goes out as its own chunk once the previous one has been
+ * flushed, so a huge directory neither stalls the loop in one long
+ * readdir nor piles up in the output buffer.
+ */
+static void 
+startListing(server *srv, evhttp_request *req, DIR *d, const char *decodePath,
+        const char *wholePath, const char *path, const struct stat &st)
+{
+    auto ls = new listing;
+    ls->srv = srv;
+    ls->req = req;
+    ls->dir = d;
+    ls->key = decodePath;
+    ls->path = wholePath;
+    ls->st = st;
+    ls->html = evbuffer_new();
+    assert(ls->html);
+
+    auto conn = srv->conns.find(evhttp_request_get_connection(req));
+    if (conn == srv->conns.end()) {
+        // the client left while the directory was opened
+        evhttp_send_reply_end(req);
+        freeListing(ls);
+        return;
+    }
+    ls->conn = conn->second;
+    ls->conn->ls = ls;
+    evhttp_send_reply_start(req, HTTP_OK, "OK");
+
+    auto chunk = evbuffer_new();
+    listingHead(chunk, decodePath, path);
+    evbuffer_add_buffer_reference(ls->html, chunk);
+    evhttp_send_reply_chunk_with_cb(req, chunk, onListingChunk, ls);
+    evbuffer_free(chunk);
+}
+
+static void 
+onListingChunk(evhttp_connection *evcon, void *arg)
+{
+    (void)evcon;
+    listing *ls = static_cast<listing*>(arg);
+    auto chunk = evbuffer_new();
+
+    if (listingEntries(chunk, ls->dir, ls->srv->o->listBatch)) {
+        evbuffer_add_buffer_reference(ls->html, chunk);
+        evhttp_send_reply_chunk_with_cb(ls->req, chunk, onListingChunk, ls);
+        evbuffer_free(chunk);
+        return;
+    }
+
+    listingTail(chunk);
+    evbuffer_add_buffer_reference(ls->html, chunk);
+    evhttp_send_reply_chunk(ls->req, chunk);
+    evbuffer_free(chunk);
+
+    ls->conn->ls = nullptr;
+    evhttp_send_reply_end(ls->req);
+    cacheListing(&ls->srv->cache, ls->html, ls->key.c_str(), ls->path.c_str(), ls->st);
+    freeListing(ls);
+}
+
+static void 
+onListingClose(listing *ls)
+{
+    // a failed connection detaches the unfinished reply, ending it frees it
+    if (!evhttp_request_get_connection(ls->req))
+        evhttp_send_reply_end(ls->req);
+    freeListing(ls);
+}
+
+static void 
+freeListing(listing *ls)
+{
+    closedir(ls->dir);
+    evbuffer_free(ls->html);
+    delete ls;
+}
+
+static void 
+cacheInit(fileCache *c, event_base *base, size_t maxBytes, size_t maxFiles,
+        size_t maxEncBytes)
+{
+    c->maxBytes = maxBytes;
+    c->maxFiles = maxFiles;
+    c->maxEncBytes = maxEncBytes;
+    if (!maxFiles) return;
+
+    c->notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (c->notifyFd < 0) {
+        perror("inotify_init1, revalidating cached files with stat");
+        return;
+    }
+    c->evNotify = event_new(base, c->notifyFd, EV_READ | EV_PERSIST, onCacheNotify, c);
+    assert(c->evNotify);
+    event_add(c->evNotify, NULL);
+}
+
+static void 
+cacheClear(fileCache *c)
+{
+    while (!c->lru.empty())
+        cacheEvict(c, c->lru.back());
+    if (c->evNotify) event_free(c->evNotify);
+    if (c->notifyFd >= 0) close(c->notifyFd);
+    c->evNotify = nullptr;
+    c->notifyFd = -1;
+}
+
+/*
+ * Without inotify every hit pays a stat(2) to notice files that were
+ * replaced or modified; with it, a hit is served without any syscall.
+ */
+static fileEntry *
+cacheLookup(fileCache *c, const char *key)
+{
+    auto it = c->entries.find(key);
+    if (it == c->entries.end()) return nullptr;
+
+    auto e = it->second;
+    if (c->notifyFd < 0) {
+        struct stat st;
+        int stale = stat(e->path.c_str(), &st) < 0 || !sameFile(e, st);
+        for (auto v : e->enc) {
+            if (!stale && v && !v->path.empty())
+                stale = stat(v->path.c_str(), &st) < 0 || !sameFile(v, st);
+        }
+        if (stale) {
+            cacheEvict(c, e);
+            return nullptr;
+        }
+    }
+
+    c->lru.splice(c->lru.begin(), c->lru, e->lru);
+    return e;
+}
+
+/*
+ * Links a prepared body into the cache. The watch is added first and the
+ * path is then checked against the stat the body was built from, so a
+ * change that raced with reading or rendering is never cached. Takes
+ * ownership of e.
+ */
+static fileEntry *
+cacheStore(fileCache *c, fileEntry *e, const char *key, const char *path,
+        const char *type, const struct stat &st, uint32_t mask)
+{
+    struct stat now;
+
+    e->key = key;
+    e->path = path;
+    e->type = type;
+    e->fsize = st.st_size;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->mtime = st.st_mtim;
+
+    if (!c->maxFiles || (e->data && (size_t)e->size > c->maxBytes)) {
+        entryUnref(e);
+        return nullptr;
+    }
+
+    int ok = cacheWatch(c, e, path, mask) && stat(path, &now) == 0 && sameFile(e, now);
+    for (auto v : e->enc) {
+        if (ok && v && !v->path.empty())
+            ok = cacheWatch(c, e, v->path.c_str(), FILE_EVENTS) &&
+                stat(v->path.c_str(), &now) == 0 && sameFile(v, now);
+    }
+    if (!ok) {
+        cacheUnwatch(c, e);
+        entryUnref(e);
+        return nullptr;
+    }
+
+    auto old = c->entries.find(e->key);
+    if (old != c->entries.end()) cacheEvict(c, old->second);
+    c->lru.push_front(e);
+    e->lru = c->lru.begin();
+    c->entries[e->key] = e;
+    if (e->data) c->bytes += e->size;
+    c->encBytes += encodedBytes(e);
+    while (c->bytes > c->maxBytes || c->entries.size() > c->maxFiles ||
+            c->encBytes > c->maxEncBytes)
+        cacheEvict(c, c->lru.back());
+    return e;
+}
+
+static int 
+cacheWatch(fileCache *c, fileEntry *e, const char *path, uint32_t mask)
+{
+    if (c->notifyFd < 0) return 1;
+
+    int wd = inotify_add_watch(c->notifyFd, path, mask);
+    if (wd < 0) {
+        perror("inotify_add_watch");
+        return 0;
+    }
+    e->wds.push_back(wd);
+    c->watches.emplace(wd, e);
+    return 1;
+}
+
+/* In-memory bytes of e's encoded variants, charged against maxEncBytes. */
+static size_t 
+encodedBytes(const fileEntry *e)
+{
+    size_t n = 0;
+    for (auto v : e->enc) {
+        if (v && v->data) n += v->size;
+    }
+    return n;
+}
+
+static int 
+sameFile(const fileEntry *e, const struct stat &st)
+{
+    return st.st_dev == e->dev && st.st_ino == e->ino && st.st_size == e->fsize &&
+        st.st_mtim.tv_sec == e->mtime.tv_sec && st.st_mtim.tv_nsec == e->mtime.tv_nsec;
+}
+
+static void 
+cacheUnwatch(fileCache *c, fileEntry *e)
+{
+    for (auto wd : e->wds) {
+        auto range = c->watches.equal_range(wd);
+        for (auto w = range.first; w != range.second; ++w) {
+            if (w->second == e) {
+                c->watches.erase(w);
+                break;
+            }
+        }
+        // paths naming the same inode share a watch descriptor
+        if (!c->watches.count(wd)) inotify_rm_watch(c->notifyFd, wd);
+    }
+    e->wds.clear();
+}
+
+static void 
+cacheEvict(fileCache *c, fileEntry *e)
+{
+    c->entries.erase(e->key);
+    c->lru.erase(e->lru);
+    if (e->data) c->bytes -= e->size;
+    c->encBytes -= encodedBytes(e);
+    cacheUnwatch(c, e);
+    entryUnref(e);
+}
+
+static void 
+cacheServe(fileEntry *e, evbuffer *buf, off_t off, off_t len)
+{
+    if (!len) return;
+    if (e->seg) {
+        evbuffer_add_file_segment(buf, e->seg, off, len);
+    } else {
+        ++e->refs;
+        evbuffer_add_reference(buf, e->data + off, len, onEntryDone, e);
+    }
+}
+
+static void 
+entryUnref(fileEntry *e)
+{
+    if (--e->refs) return;
+    for (auto v : e->enc) {
+        if (v) entryUnref(v);
+    }
+    if (e->seg) evbuffer_file_segment_free(e->seg);
+    free(e->data);
+    delete e;
+}
+
+static void 
+onEntryDone(const void *data, size_t len, void *arg)
+{
+    (void)data; (void)len;
+    entryUnref(static_cast<fileEntry*>(arg));
+}
+
+static void 
+onCacheNotify(evutil_socket_t fd, short what, void *arg)
+{
+    (void)what;
+    fileCache *c = static_cast<fileCache*>(arg);
+    alignas(inotify_event) char buf[4096];
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            auto ev = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + ev->len;
+
+            auto range = c->watches.equal_range(ev->wd);
+            std::vector<fileEntry*> stale;
+            for (auto w = range.first; w != range.second; ++w) 
+                stale.push_back(w->second);
+            for (auto e : stale) {
+                // the kernel already dropped the watch
+                if (ev->mask & IN_IGNORED) {
+                    c->watches.erase(ev->wd);
+                    std::erase(e->wds, ev->wd);
+                }
+                cacheEvict(c, e);
+            }
+        }
+    }
+}
 
 static void 
 usage(FILE *handle, const char *progName, int exitCode)
@@ -310,6 +2834,36 @@ usage(FILE *handle, const char *progName, int exitCode)
             " -U        - bind to unix socket\n"
             " -u        - unlink unix socket before bind\n"
             " -I        - IOCP\n"
+            " -c        - MiB of small files kept in memory (default 64)\n"
+            " -z        - MiB of gzip bodies compressed on the fly, on an I/O\n"
+            "             thread even without -a (default 16)\n"
+            " -f        - max number of cached files, 0 disables the cache\n"
+            "             (default 1024)\n"
+            " -L        - stream directory listings, reading this many entries\n"
+            "             per chunk\n"
+            " -j        - serve on this many threads, each with its own\n"
+            "             event_base and evhttp (default 1)\n"
+            " -a        - run stat/open/read and directory listings of cache\n"
+            "             misses on this many I/O threads (default 0, inline);\n"
+            "             listings are then rendered whole, -L is ignored\n"
+            " -m        - mime.types file, overrides the built-in types\n"
+            " -B        - time this many rounds of content type lookups\n"
+            "             against a linear scan and exit\n"
+            " -t        - seconds a connection may take to send a request or\n"
+            "             read a reply (default 50)\n"
+            " -k        - close keep-alive connections idle this many seconds,\n"
+            "             0 leaves that to -t (default 15)\n"
+            " -C        - max open connections; new ones get a 503 and idle\n"
+            "             keep-alives are closed while at the limit\n"
+            " -b        - max request body size in bytes\n"
+            " -H        - max request header size in bytes\n"
+            " -l        - log level: 0 none, 1 access log (default), 2 also\n"
+            "             request headers and /dump bodies\n"
+            " -A        - access log file (default stdout)\n"
+            " -D        - stream POST/PUT /dump bodies with a Content-Length\n"
+            "             to a file each, named this plus .<n>, as they arrive\n"
+            "             instead of buffering; written by an I/O thread even\n"
+            "             without -a\n"
             " -v        - verbosity, enables libevent debug logging too\n",
             progName);
     exit(exitCode);
@@ -321,13 +2875,29 @@ parseOpts(int c, char **v)
     options o;
     int opt;
 
-    while((opt = getopt(c, v, "hp:U:uIv")) != -1) {
+    while((opt = getopt(c, v, "hp:U:uIvc:f:z:L:j:a:m:B:t:k:C:b:H:l:A:D:")) != -1) {
         switch (opt) {
             case 'p': o.port=atoi(optarg); break;
             case 'U': o.unixSock =optarg; break;
             case 'u': o.unlink = 1; break;
             case 'I': o.iocp = 1; break;
             case 'v': ++o.verbose; break;
+            case 'c': o.cacheBytes = (size_t)atol(optarg) << 20; break;
+            case 'f': o.cacheFiles = atol(optarg); break;
+            case 'z': o.encBytes = (size_t)atol(optarg) << 20; break;
+            case 'L': o.listBatch = atol(optarg); break;
+            case 'j': o.threads = atoi(optarg); break;
+            case 'a': o.ioThreads = atoi(optarg); break;
+            case 'm': o.mimeFile = optarg; break;
+            case 'B': o.benchLookups = atol(optarg); break;
+            case 't': o.timeout = atoi(optarg); break;
+            case 'k': o.keepAlive = atoi(optarg); break;
+            case 'C': o.maxConns = atol(optarg); break;
+            case 'b': o.maxBody = atol(optarg); break;
+            case 'H': o.maxHeaders = atol(optarg); break;
+            case 'l': o.logLevel = atoi(optarg); break;
+            case 'A': o.accessLog = optarg; break;
+            case 'D': o.dumpFile = optarg; break;
             case 'h': usage(stdout, v[0], 0); break;
             default: 
                 {
@@ -338,7 +2908,8 @@ parseOpts(int c, char **v)
         }
     }
 
-    if (optind >= c || (c - optind) > 1) {
+    if ((optind >= c && !o.benchLookups) || (c - optind) > 1 || o.threads < 1 ||
+            o.ioThreads < 0 || o.timeout < 0 || o.keepAlive < 0 || o.maxConns < 0) {
         usage(stdout, v[0], 1);
     }
 
@@ -350,7 +2921,8 @@ static void
 onTerm(int sigNo, short event, void *arg)
 {
     (void) event;
-    event_base_loopbreak(static_cast<event_base*>(arg));
+    for (auto &srv : *static_cast<std::vector<server>*>(arg))
+        event_base_loopbreak(srv.base);
     fprintf(stderr, "Got %i, Terminating...\n", sigNo);
 }
 static int 
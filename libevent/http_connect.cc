@@ -1,5 +1,7 @@
 #include <unistd.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <sys/time.h>
 
 #include <event2/event.h>
 #include <event2/http.h>
@@ -8,6 +10,12 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 
 using namespace std;
@@ -21,100 +29,474 @@ using namespace std;
     }   \
 } while (0)
 
+struct fetch {
+    string url;
+    string key;             // its pool
+    size_t seq = 0;         // output file name under -o
+    int    fd = -1;         // body output, opened on the first bytes
+    evbuffer *body = nullptr; // without -o, held until the fetch is done
+    size_t bytes = 0;
+    string hostAndPort;     // CONNECT target
+    string host;            // Host header
+    string path;
+};
+
+/*
+ * A CONNECT tunnel through the proxy to one target. It carries one
+ * fetch at a time and goes back to its host's pool when that is done.
+ */
+struct tunnel {
+    string             key;
+    evhttp_connection *conn = nullptr;
+    fetch             *current = nullptr;   // nullptr while idle
+    int                open = 0;            // proxy answered the CONNECT
+    int                closed = 0;
+    int                dropped = 0;
+    timeval            idleSince = {};
+};
+
+struct hostPool {
+    vector<tunnel*> tunnels;
+    deque<fetch*>   waiting;
+};
+
 event_base *base        = nullptr;
-evhttp_connection *conn = nullptr;
-evhttp_uri *location    = nullptr;
+evhttp_uri *proxy       = nullptr;
+event *evReap           = nullptr;
+event *evFree           = nullptr;
+vector<tunnel*> freeing;    // dropped, freed by evFree outside their callbacks
 
+// tunnels keyed by "proxy target", both as host:port; ready holds the
+// keys with fetches waiting, in round-robin order
+unordered_map<string, hostPool> pool;
+deque<string> ready;
+int maxPerHost          = 4;
+int idleTimeout         = 30;
+int maxInFlight         = 64;
+const char *outDir      = nullptr;
+size_t pending          = 0;
+size_t failed           = 0;
+int inFlight            = 0;
+
+static void usage(char *);
 static evhttp_uri *uriParse(const char *);
+static evhttp_uri *uriTry(const char *);
+static void readList(FILE *);
+static void fetchQueue(const char *);
+static void fetchWrite(fetch *, evbuffer *);
+static void fetchDone(fetch *);
+static void schedule();
+static int poolStart(hostPool &, const string &);
+static void tunnelOpen(const string &, fetch *);
+static void tunnelDrop(tunnel *);
+static void tunnelFree(evutil_socket_t, short, void *);
+static void sendGet(tunnel *);
 static void onConnect(evhttp_request *, void *);
 static void onGet(evhttp_request *, void *);
+static void onBody(evhttp_request *, void *);
+static void onTunnelClose(evhttp_connection *, void *);
+static void onReap(evutil_socket_t, short, void *);
 
 int main(int argc, char **argv)
 {
-
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s proxy url\n", argv[0]);
-        exit(EXIT_FAILURE);
+    int opt;
+    const char *list = nullptr;
+    while ((opt = getopt(argc, argv, "n:i:c:f:o:")) != -1) {
+        switch (opt) {
+            case 'n': maxPerHost = atoi(optarg); break;
+            case 'i': idleTimeout = atoi(optarg); break;
+            case 'c': maxInFlight = atoi(optarg); break;
+            case 'f': list = optarg; break;
+            case 'o': outDir = optarg; break;
+            default: usage(argv[0]);
+        }
     }
 
+    if (argc - optind < 1 + !list || maxPerHost < 1 || idleTimeout < 1 || maxInFlight < 1)
+        usage(argv[0]);
 
-    char hostAndPort[URL_MAX];
-    evhttp_request *req = nullptr;
-    auto proxy      = uriParse(argv[1]);
-    location        = uriParse(argv[2]);
-  
+    proxy = uriParse(argv[optind]);
     VERIFY(base = event_base_new());
-    VERIFY(conn = evhttp_connection_base_new(base, NULL, evhttp_uri_get_host(proxy),
-        evhttp_uri_get_port(proxy)));
-    VERIFY(req = evhttp_request_new(onConnect, NULL));
-
-    
-    VERIFY(evhttp_uri_join(location, hostAndPort, sizeof(hostAndPort)));
-    printf("evhttp_uri_join result: [%s]\n", hostAndPort);
-
-    auto host_ = evhttp_uri_get_host(location);
-    int port_ = 0;
-    VERIFY(host_ != NULL);
-    VERIFY((port_ = evhttp_uri_get_port((const evhttp_uri*)location)) > 0);
-    evutil_snprintf(hostAndPort, sizeof(hostAndPort), "%s:%d",
-        host_, port_);
-    
-
-    evhttp_add_header(req->output_headers, "Connection", "keep-alive");
-    evhttp_add_header(req->output_headers, "Proxy-Connection", "keep-alive");
-    evhttp_add_header(req->output_headers, "Host", hostAndPort);
+    VERIFY(evReap = event_new(base, -1, EV_PERSIST, onReap, NULL));
+    timeval second = { .tv_sec = 1, .tv_usec = 0 };
+    event_add(evReap, &second);
+    VERIFY(evFree = event_new(base, -1, 0, tunnelFree, NULL));
 
-    evhttp_make_request(conn, req, EVHTTP_REQ_CONNECT, hostAndPort);
+    for (int i = optind + 1; i < argc; ++i)
+        fetchQueue(argv[i]);
+    if (list) {
+        auto in = strcmp(list, "-") ? fopen(list, "r") : stdin;
+        if (!in) {
+            perror(list);
+            exit(EXIT_FAILURE);
+        }
+        readList(in);
+        if (in != stdin) fclose(in);
+    }
 
-    event_base_dispatch(base);
+    schedule();
+    if (pending)
+        event_base_dispatch(base);
 
-    evhttp_connection_free(conn);
+    tunnelFree(-1, 0, NULL);
+    for (auto &it : pool) {
+        for (auto t : it.second.tunnels) {
+            evhttp_connection_set_closecb(t->conn, NULL, NULL);
+            evhttp_connection_free(t->conn);
+            delete t;
+        }
+    }
+    pool.clear();
+    event_free(evFree);
+    event_free(evReap);
     event_base_free(base);
 
     evhttp_uri_free(proxy);
-    evhttp_uri_free(location);
 
+    if (failed) {
+        fprintf(stderr, "%zu fetches failed\n", failed);
+        return EXIT_FAILURE;
+    }
     return 0;
 }
 
+static void usage(char *argv)
+{
+    fprintf(stderr, "Usage: %s [-n max-per-host] [-i idle-seconds] [-c in-flight]\n"
+        "       [-f list] [-o dir] proxy [url...]\n"
+        " -n        - tunnels kept open to one target (default 4)\n"
+        " -i        - close a tunnel idle for this long (default 30)\n"
+        " -c        - fetches in flight over all targets (default 64)\n"
+        " -f        - also fetch the URLs in this file, one per line,\n"
+        "             - for stdin; bad ones are reported and skipped\n"
+        " -o        - write each body to dir/<n>, n counting the URLs from 0,\n"
+        "             and print \"status bytes url\" for it; bodies go to\n"
+        "             stdout otherwise\n", argv);
+    exit(EXIT_FAILURE);
+}
 
 static evhttp_uri *uriParse(const char *strUri)
 {
     evhttp_uri *uri;
 
-    VERIFY(uri = evhttp_uri_parse(strUri));
-    VERIFY(evhttp_uri_get_host(uri));
-    VERIFY(evhttp_uri_get_port(uri) > 0);
+    VERIFY(uri = uriTry(strUri));
 
     return uri;
 }
 
-static void onConnect(evhttp_request *req, void *arg)
+/* nullptr for a URL without a host or a usable port */
+static evhttp_uri *uriTry(const char *strUri)
+{
+    auto uri = evhttp_uri_parse(strUri);
+
+    if (!uri) return nullptr;
+    if (evhttp_uri_get_port(uri) < 0) evhttp_uri_set_port(uri, 80);
+    auto host = evhttp_uri_get_host(uri);
+    if (!host || !*host || evhttp_uri_get_port(uri) <= 0) {
+        evhttp_uri_free(uri);
+        return nullptr;
+    }
+
+    return uri;
+}
+
+static void readList(FILE *in)
 {
-    VERIFY(req);
+    char *line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &cap, in)) > 0) {
+        while (len > 0 && strchr(" \t\r\n", line[len - 1]))
+            line[--len] = '\0';
+        if (len > 0 && *line != '#')
+            fetchQueue(line);
+    }
+    free(line);
+}
 
-    auto r = evhttp_request_new(onGet, NULL);
-    evhttp_add_header(req->output_headers, "Connection", "close");
-    evhttp_add_header(req->output_headers, "Host", evhttp_uri_get_host(location));
-    
+static void fetchQueue(const char *url)
+{
+    static size_t seq;
     char buff[URL_MAX];
+    auto location = uriTry(url);
+
+    // one bad line should not take the rest of a -f list with it
+    if (!location) {
+        fprintf(stderr, "%s: bad URL\n", url);
+        ++seq;
+        ++failed;
+        return;
+    }
+
+    auto f = new fetch;
+    f->url = url;
+    f->seq = seq++;
+    auto host_ = evhttp_uri_get_host(location);
+    int port_ = evhttp_uri_get_port(location);
+    evutil_snprintf(buff, sizeof(buff), "%s:%d", host_, port_);
+    f->hostAndPort = buff;
+    f->host = port_ == 80 ? host_ : buff;
+
+    evutil_snprintf(buff, sizeof(buff), "%s:%d %s", evhttp_uri_get_host(proxy),
+        evhttp_uri_get_port(proxy), f->hostAndPort.c_str());
+    f->key = buff;
+
+    evhttp_uri_set_scheme(location, NULL);
+    evhttp_uri_set_userinfo(location, NULL);
+    evhttp_uri_set_host(location, NULL);
+    evhttp_uri_set_port(location, -1);
     VERIFY(evhttp_uri_join(location, buff, sizeof(buff)));
-    auto path = evhttp_uri_parse(buff);
-    evhttp_uri_set_scheme(path, NULL);
-    evhttp_uri_set_userinfo(path, NULL);
-    evhttp_uri_set_host(path, NULL);
-    evhttp_uri_set_port(path, -1);
+    f->path = *buff ? buff : "/";
+    evhttp_uri_free(location);
 
-    VERIFY(evhttp_uri_join(path, buff, sizeof(buff)));
-    
-    VERIFY(!evhttp_make_request(conn, r, EVHTTP_REQ_GET, buff));
+    auto &hp = pool[f->key];
+    if (hp.waiting.empty())
+        ready.push_back(f->key);
+    hp.waiting.push_back(f);
+    ++pending;
 }
-static void 
+
+/*
+ * Write what has arrived of the body to its file straight from the evbuffer
+ * chain and drain it, so no more than one read is ever held. Bodies bound
+ * for stdout would interleave there, so they are kept whole in f->body and
+ * written once the fetch is done.
+ */
+static void fetchWrite(fetch *f, evbuffer *buff)
+{
+    if (f->fd < 0 && !outDir) {
+        if (!f->body)
+            VERIFY(f->body = evbuffer_new());
+        evbuffer_add_buffer(f->body, buff);
+        return;
+    }
+    if (f->fd < 0) {
+        char path[PATH_MAX];
+        evutil_snprintf(path, sizeof(path), "%s/%zu", outDir, f->seq);
+        if ((f->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+            perror(path);
+    }
+
+    while (evbuffer_get_length(buff) > 0) {
+        int n = f->fd < 0 ? -1 : evbuffer_write(buff, f->fd);
+        if (n < 0) {
+            if (f->fd >= 0) perror("evbuffer_write");
+            evbuffer_drain(buff, evbuffer_get_length(buff));
+            break;
+        }
+        f->bytes += n;
+    }
+}
+
+static void fetchDone(fetch *f)
+{
+    if (f->fd >= 0 && f->fd != STDOUT_FILENO)
+        close(f->fd);
+    if (f->body)
+        evbuffer_free(f->body);
+    delete f;
+    --inFlight;
+    if (--pending == 0)
+        event_base_loopexit(base, NULL);
+}
+
+/*
+ * Start queued fetches one target at a time, round-robin, so a long list
+ * for one host does not hold up the others. Stops at -c fetches in flight
+ * or when every target with work queued is at its -n tunnels.
+ */
+static void schedule()
+{
+    size_t stalled = 0;
+    while (inFlight < maxInFlight && stalled < ready.size()) {
+        auto key = ready.front();
+        ready.pop_front();
+        auto &hp = pool[key];
+        if (poolStart(hp, key))
+            stalled = 0;
+        else
+            ++stalled;
+        if (!hp.waiting.empty())
+            ready.push_back(key);
+    }
+}
+
+/* Give the next fetch for key an idle tunnel or a new one; 0 if it has to wait. */
+static int poolStart(hostPool &hp, const string &key)
+{
+    tunnel *idle = nullptr;
+    for (auto t : hp.tunnels) {
+        if (t->open && !t->current) {
+            idle = t;
+            break;
+        }
+    }
+    if (!idle && (int)hp.tunnels.size() >= maxPerHost)
+        return 0;
+
+    auto f = hp.waiting.front();
+    hp.waiting.pop_front();
+    ++inFlight;
+    if (idle) {
+        idle->current = f;
+        sendGet(idle);
+    } else {
+        tunnelOpen(key, f);
+    }
+    return 1;
+}
+
+static void tunnelOpen(const string &key, fetch *f)
+{
+    evhttp_request *req = nullptr;
+    auto t = new tunnel;
+
+    t->key = key;
+    t->current = f;
+    VERIFY(t->conn = evhttp_connection_base_new(base, NULL, evhttp_uri_get_host(proxy),
+        evhttp_uri_get_port(proxy)));
+    evhttp_connection_set_closecb(t->conn, onTunnelClose, t);
+    pool[key].tunnels.push_back(t);
+
+    VERIFY(req = evhttp_request_new(onConnect, t));
+    evhttp_add_header(req->output_headers, "Connection", "keep-alive");
+    evhttp_add_header(req->output_headers, "Proxy-Connection", "keep-alive");
+    evhttp_add_header(req->output_headers, "Host", f->hostAndPort.c_str());
+
+    VERIFY(!evhttp_make_request(t->conn, req, EVHTTP_REQ_CONNECT, f->hostAndPort.c_str()));
+}
+
+/*
+ * Take t out of its pool. A closed tunnel must not be used again: evhttp
+ * would quietly reconnect to the proxy and send the GET to it in the clear.
+ */
+static void tunnelDrop(tunnel *t)
+{
+    if (t->dropped)
+        return;
+    t->dropped = 1;
+
+    auto &hp = pool[t->key];
+    for (auto it = hp.tunnels.begin(); it != hp.tunnels.end(); ++it) {
+        if (*it == t) {
+            hp.tunnels.erase(it);
+            break;
+        }
+    }
+
+    // we may be inside one of the connection's callbacks
+    freeing.push_back(t);
+    event_active(evFree, EV_TIMEOUT, 0);
+}
+
+static void tunnelFree(evutil_socket_t fd, short event, void *arg)
+{
+    (void)fd; (void)event; (void)arg;
+    vector<tunnel*> gone;
+    gone.swap(freeing);
+    for (auto t : gone) {
+        evhttp_connection_set_closecb(t->conn, NULL, NULL);
+        evhttp_connection_free(t->conn);
+        delete t;
+    }
+}
+
+static void sendGet(tunnel *t)
+{
+    auto f = t->current;
+    auto r = evhttp_request_new(onGet, t);
+    VERIFY(r);
+    evhttp_request_set_chunked_cb(r, onBody);
+    evhttp_add_header(r->output_headers, "Connection", "keep-alive");
+    evhttp_add_header(r->output_headers, "Host", f->host.c_str());
+
+    VERIFY(!evhttp_make_request(t->conn, r, EVHTTP_REQ_GET, f->path.c_str()));
+}
+
+static void onConnect(evhttp_request *req, void *arg)
+{
+    auto t = static_cast<tunnel*>(arg);
+
+    if (!req || evhttp_request_get_response_code(req) != HTTP_OK) {
+        fprintf(stderr, "%s: CONNECT failed (%d)\n", t->current->url.c_str(),
+            req ? evhttp_request_get_response_code(req) : 0);
+        ++failed;
+        fetchDone(t->current);
+        t->current = nullptr;
+        tunnelDrop(t);
+        schedule();
+        return;
+    }
+
+    t->open = 1;
+    sendGet(t);
+}
+
+static void
 onGet(evhttp_request *req, void *arg)
 {
-    VERIFY(req);
-    auto buff = evhttp_request_get_input_buffer(req);
-    auto len = evbuffer_get_length(buff);
-    fwrite(evbuffer_pullup(buff, len), len, 1, stdout);
-    evbuffer_drain(buff, len);
-}
\ No newline at end of file
+    auto t = static_cast<tunnel*>(arg);
+    auto f = t->current;
+    int status = req ? evhttp_request_get_response_code(req) : 0;
+
+    if (!status) {
+        fprintf(stderr, "%s: request failed\n", f->url.c_str());
+        ++failed;
+    } else {
+        // an empty body never went through onBody
+        fetchWrite(f, evhttp_request_get_input_buffer(req));
+        if (outDir)
+            printf("%d %zu %s\n", status, f->bytes, f->url.c_str());
+        else if (f->body) {
+            f->fd = STDOUT_FILENO;
+            fetchWrite(f, f->body);
+        }
+    }
+
+    fetchDone(f);
+    t->current = nullptr;
+    if (!status || t->closed)
+        tunnelDrop(t);
+    else
+        evutil_gettimeofday(&t->idleSince, NULL);
+    schedule();
+}
+
+/* Body bytes as they come off the socket; evhttp keeps none of them. */
+static void onBody(evhttp_request *req, void *arg)
+{
+    auto t = static_cast<tunnel*>(arg);
+    fetchWrite(t->current, evhttp_request_get_input_buffer(req));
+}
+
+/* The proxy or the target closed the tunnel; an idle one just leaves the pool. */
+static void onTunnelClose(evhttp_connection *conn, void *arg)
+{
+    (void)conn;
+    auto t = static_cast<tunnel*>(arg);
+    t->closed = 1;
+    if (!t->current) {
+        tunnelDrop(t);
+        schedule();
+    }
+}
+
+static void onReap(evutil_socket_t fd, short event, void *arg)
+{
+    (void)fd; (void)event; (void)arg;
+    timeval now;
+    vector<tunnel*> idle;
+
+    evutil_gettimeofday(&now, NULL);
+    for (auto &it : pool) {
+        for (auto t : it.second.tunnels) {
+            if (t->open && !t->current && now.tv_sec - t->idleSince.tv_sec >= idleTimeout)
+                idle.push_back(t);
+        }
+    }
+    for (auto t : idle)
+        tunnelDrop(t);
+    if (!idle.empty())
+        schedule();
+}
@@ -2,34 +2,193 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <errno.h>
+#include <signal.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 #include <event2/bufferevent_ssl.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
 #include <event2/listener.h>
 #include <event2/util.h>
 #include <event2/http.h>
+#include <event2/http_struct.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/rand.h>
 
+/*
+ * Requests go out one at a time. With reuse they share one keep-alive TLS
+ * connection; otherwise, or once the server closes it, every request gets a
+ * new one, which with resume offers the last session (ticket or ID) the
+ * server gave us for this host.
+ */
+struct client {
+	event_base		*base = nullptr;
+	SSL_CTX			*ctx = nullptr;
+	std::string		host;
+	int			port = 443;
+	std::string		path;
+	std::string		data;		// POST body, GET when empty
+	int			retries = 0;
+	int			timeout = 0;
+	int			reuse = 1;
+	int			resume = 1;
+	int			quiet = 0;
+
+	evhttp_connection	*conn = nullptr;
+	bufferevent		*bev = nullptr;
+	int			closed = 0;
+	int			left = 0;
+	int			tries = 0;
+	timespec		start = {};
+
+	std::vector<uint32_t>	latencies;
+	int			handshakes = 0;
+	int			resumed = 0;
+	int			failed = 0;
+};
+
 static int ignoreCert = 0;
 
+// the newest session per host:port, owned here
+static std::unordered_map<std::string, SSL_SESSION*> sessions;
+
 static void onRequestDone(evhttp_request*, void*);
+static int keepsAlive(evhttp_request *);
 static void usage(char *);
+static SSL_CTX *newContext(const char *);
+static int onNewSession(SSL *, SSL_SESSION *);
+static void onHandshake(const SSL *, int, int);
+static void newConnection(client *);
+static void freeConnection(client *);
+static void sendRequest(client *);
+static void nextRequest(evutil_socket_t, short, void *);
+static void onClose(evhttp_connection *, void *);
+static void run(client *, int);
+static void report(const char *, client *, double);
+
+int
+main(int argc, char **argv)
+{
+	const char *url = nullptr, *dataFile = nullptr, *crt = nullptr;
+	int count = 1, bench = 0;
+	client c;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp("-url", argv[i]) && i < argc - 1) {
+			url = argv[++i];
+		} else if (!strcmp("-data", argv[i]) && i < argc - 1) {
+			dataFile = argv[++i];
+		} else if (!strcmp("-ignore-cert", argv[i])) {
+			ignoreCert = 1;
+		} else if (!strcmp("-retries", argv[i]) && i < argc - 1) {
+			c.retries = atoi(argv[++i]);
+		} else if (!strcmp("-timeout", argv[i]) && i < argc - 1) {
+			c.timeout = atoi(argv[++i]);
+		} else if (!strcmp("-crt", argv[i]) && i < argc - 1) {
+			crt = argv[++i];
+		} else if (!strcmp("-n", argv[i]) && i < argc - 1) {
+			count = atoi(argv[++i]);
+		} else if (!strcmp("-no-reuse", argv[i])) {
+			c.reuse = 0;
+		} else if (!strcmp("-no-resume", argv[i])) {
+			c.resume = 0;
+		} else if (!strcmp("-bench", argv[i])) {
+			bench = 1;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (!url || count < 1)
+		usage(argv[0]);
 
-static void 
+	auto uri = evhttp_uri_parse(url);
+	if (!uri || !evhttp_uri_get_scheme(uri) || strcasecmp(evhttp_uri_get_scheme(uri), "https")
+			|| !evhttp_uri_get_host(uri)) {
+		fprintf(stderr, "url must be https://host[:port][/path]\n");
+		return 1;
+	}
+	c.host = evhttp_uri_get_host(uri);
+	if (evhttp_uri_get_port(uri) > 0)
+		c.port = evhttp_uri_get_port(uri);
+	c.path = evhttp_uri_get_path(uri) && *evhttp_uri_get_path(uri) ? evhttp_uri_get_path(uri) : "/";
+	if (evhttp_uri_get_query(uri))
+		c.path += std::string("?") + evhttp_uri_get_query(uri);
+	evhttp_uri_free(uri);
+
+	if (dataFile) {
+		FILE *f = fopen(dataFile, "rb");
+		char buffer[4096];
+		size_t n;
+		if (!f) {
+			perror(dataFile);
+			return 1;
+		}
+		while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+			c.data.append(buffer, n);
+		fclose(f);
+	}
+
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		perror("signal");
+		return 1;
+	}
+
+	if (!(c.ctx = newContext(crt)))
+		return 1;
+	c.base = event_base_new();
+	assert(c.base);
+
+	if (!bench) {
+		run(&c, count);
+	} else {
+		// every mode starts without a cached session
+		struct { const char *name; int reuse, resume; } modes[] = {
+			{ "full handshake", 0, 0 },
+			{ "resumed", 0, 1 },
+			{ "keep-alive", 1, 1 },
+		};
+		c.quiet = 1;
+		for (auto &m : modes) {
+			timespec start, end;
+			for (auto &it : sessions) SSL_SESSION_free(it.second);
+			sessions.clear();
+			c.reuse = m.reuse;
+			c.resume = m.resume;
+			c.latencies.clear();
+			c.handshakes = c.resumed = c.failed = 0;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			run(&c, count);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			report(m.name, &c, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+		}
+	}
+
+	for (auto &it : sessions) SSL_SESSION_free(it.second);
+	event_base_free(c.base);
+	SSL_CTX_free(c.ctx);
+	return c.failed ? 1 : 0;
+}
+
+static void
 onRequestDone(evhttp_request *req, void *arg)
 {
 	char buffer[256];
 	int nread;
-	if (!req || !evhttp_request_get_reponse_code(req)) {
-		bufferevent *bev = (bufferevent*) arg;
+	client *c = (client*) arg;
+
+	if (!req || !evhttp_request_get_response_code(req)) {
+		bufferevent *bev = c->bev;
 		unsigned long oslerr;
 		int printErr = 0;
 		int errCode = EVUTIL_SOCKET_ERROR();
@@ -39,27 +198,241 @@ onRequestDone(evhttp_request *req, void *arg)
 			printErr = 1;
 		}
 
-		if (!printErr) 
+		if (!printErr)
 			fprintf(stderr, "socket error = %s (%d)\n", evutil_socket_error_to_string(errCode), errCode);
+
+		// the connection is done for, retry on a new one
+		c->closed = 1;
+		if (c->tries++ >= c->retries) {
+			c->failed++;
+			c->left--;
+			c->tries = 0;
+		}
+		event_base_once(c->base, -1, EV_TIMEOUT, nextRequest, c, NULL);
 		return;
 	}
 
-	fprintf(stdout, "Response line: %d %s\n",
-	evhttp_request_get_response_code(req),
-	evhttp_request_get_response_code_line(req));
-		
-	while ((nread = evbuffer_remove(evhttp_request_get_input_buffer(req), buffer, sizeof(buffer)) > 0) {
-			fwrite(buffer, nread, 1, stdout);
+	timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	c->latencies.push_back((end.tv_sec - c->start.tv_sec) * 1000000 +
+		(end.tv_nsec - c->start.tv_nsec) / 1000);
+	c->left--;
+	c->tries = 0;
+	// a reply that ends at EOF may never get to onClose
+	if (!keepsAlive(req) && !c->closed)
+		onClose(c->conn, c);
+
+	if (!c->quiet) {
+		fprintf(stdout, "Response line: %d %s\n",
+		evhttp_request_get_response_code(req),
+		evhttp_request_get_response_code_line(req));
+
+		while ((nread = evbuffer_remove(evhttp_request_get_input_buffer(req), buffer, sizeof(buffer))) > 0) {
+				fwrite(buffer, nread, 1, stdout);
+		}
 	}
+
+	// a connection cannot be freed from inside its own callback
+	event_base_once(c->base, -1, EV_TIMEOUT, nextRequest, c, NULL);
 }
 
-static void 
+/* Whether the server leaves the connection open after this response. */
+static int
+keepsAlive(evhttp_request *req)
+{
+	const char *conn = evhttp_find_header(evhttp_request_get_input_headers(req), "Connection");
+
+	if (conn && !evutil_ascii_strcasecmp(conn, "close"))
+		return 0;
+	if (req->major < 1 || (req->major == 1 && req->minor < 1))
+		return conn && !evutil_ascii_strcasecmp(conn, "keep-alive");
+	return 1;
+}
+
+static void
 usage(char *prog)
 {
-	fprintf(stderr,"Usage: %s -url <https-url> [-data data-file.bin] [-ignore-cert] [-retries num] [-timeout sec] [-crt crt]\n",
+	fprintf(stderr,"Usage: %s -url <https-url> [-data data-file.bin] [-ignore-cert] [-retries num] [-timeout sec] [-crt crt]\n"
+			"       [-n requests] [-no-reuse] [-no-resume] [-bench]\n",
 			prog);
-	fprintf(stderr "Example: %s -url https://ip.appspot.com/\n", prog);
+	fprintf(stderr, "Example: %s -url https://ip.appspot.com/\n", prog);
+	fprintf(stderr, " -n           - send the request this many times, one after another\n"
+			" -no-reuse    - a new TLS connection for every request\n"
+			" -no-resume   - do not offer cached TLS sessions on new connections\n"
+			" -bench       - run the -n requests with full handshakes, with resumed\n"
+			"                ones and over one keep-alive connection, and print\n"
+			"                handshakes/s and latency for each\n");
 	exit(EXIT_FAILURE);
 }
 
+static SSL_CTX *
+newContext(const char *crt)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	if (!ctx) {
+		ERR_print_errors_fp(stderr);
+		return nullptr;
+	}
+
+	if (!ignoreCert) {
+		if (crt ? !SSL_CTX_load_verify_locations(ctx, crt, NULL) : !SSL_CTX_set_default_verify_paths(ctx)) {
+			ERR_print_errors_fp(stderr);
+			SSL_CTX_free(ctx);
+			return nullptr;
+		}
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	}
 
+	// tickets and IDs land in onNewSession, TLS 1.3 ones after the handshake
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, onNewSession);
+	SSL_CTX_set_info_callback(ctx, onHandshake);
+	return ctx;
+}
+
+static int
+onNewSession(SSL *ssl, SSL_SESSION *session)
+{
+	auto c = (client*) SSL_get_app_data(ssl);
+	auto key = c->host + ":" + std::to_string(c->port);
+	auto &slot = sessions[key];
+	if (slot)
+		SSL_SESSION_free(slot);
+	slot = session;
+	return 1;
+}
+
+/* Count handshakes here; by the time a response is in the SSL may be cleared. */
+static void
+onHandshake(const SSL *ssl, int where, int ret)
+{
+	(void)ret;
+	if (!(where & SSL_CB_HANDSHAKE_DONE))
+		return;
+	auto c = (client*) SSL_get_app_data(ssl);
+	c->handshakes++;
+	c->resumed += SSL_session_reused(ssl);
+}
+
+static void
+newConnection(client *c)
+{
+	SSL *ssl = SSL_new(c->ctx);
+	assert(ssl);
+	SSL_set_app_data(ssl, c);
+	SSL_set_tlsext_host_name(ssl, c->host.c_str());
+	if (!ignoreCert)
+		SSL_set1_host(ssl, c->host.c_str());
+
+	if (c->resume) {
+		auto it = sessions.find(c->host + ":" + std::to_string(c->port));
+		if (it != sessions.end())
+			SSL_set_session(ssl, it->second);
+	}
+
+	c->bev = bufferevent_openssl_socket_new(c->base, -1, ssl, BUFFEREVENT_SSL_CONNECTING,
+		BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+	assert(c->bev);
+	bufferevent_openssl_set_allow_dirty_shutdown(c->bev, 1);
+
+	c->conn = evhttp_connection_base_bufferevent_new(c->base, NULL, c->bev,
+		c->host.c_str(), c->port);
+	assert(c->conn);
+	if (c->timeout > 0)
+		evhttp_connection_set_timeout(c->conn, c->timeout);
+	evhttp_connection_set_closecb(c->conn, onClose, c);
+	c->closed = 0;
+}
+
+static void
+freeConnection(client *c)
+{
+	if (!c->conn)
+		return;
+	if (!c->closed)
+		SSL_shutdown(bufferevent_openssl_get_ssl(c->bev));
+	// frees the bufferevent, and with it the SSL and the socket
+	evhttp_connection_set_closecb(c->conn, NULL, NULL);
+	evhttp_connection_free(c->conn);
+	c->conn = nullptr;
+	c->bev = nullptr;
+}
+
+static void
+sendRequest(client *c)
+{
+	// evhttp would reconnect a closed connection on the same, spent, SSL
+	if (c->conn && (c->closed || !c->reuse))
+		freeConnection(c);
+	if (!c->conn)
+		newConnection(c);
+
+	evhttp_request *req = evhttp_request_new(onRequestDone, c);
+	assert(req);
+	auto headers = evhttp_request_get_output_headers(req);
+	evhttp_add_header(headers, "Host", c->host.c_str());
+	evhttp_add_header(headers, "Connection", c->reuse ? "keep-alive" : "close");
+	if (!c->data.empty()) {
+		char len[32];
+		evutil_snprintf(len, sizeof(len), "%zu", c->data.size());
+		evhttp_add_header(headers, "Content-Length", len);
+		evbuffer_add(evhttp_request_get_output_buffer(req), c->data.data(), c->data.size());
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+	if (evhttp_make_request(c->conn, req, c->data.empty() ? EVHTTP_REQ_GET : EVHTTP_REQ_POST,
+			c->path.c_str())) {
+		fprintf(stderr, "evhttp_make_request() failed\n");
+		c->failed++;
+		c->left = 0;
+		event_base_loopexit(c->base, NULL);
+	}
+}
+
+static void
+nextRequest(evutil_socket_t fd, short what, void *arg)
+{
+	(void)fd; (void)what;
+	client *c = (client*) arg;
+	if (c->left > 0)
+		sendRequest(c);
+	else
+		event_base_loopexit(c->base, NULL);
+}
+
+/*
+ * Called before evhttp closes the socket and resets the bufferevent, which
+ * clears the SSL; without a close_notify sent by then OpenSSL marks the
+ * session not resumable.
+ */
+static void
+onClose(evhttp_connection *conn, void *arg)
+{
+	(void)conn;
+	client *c = (client*) arg;
+	SSL_shutdown(bufferevent_openssl_get_ssl(c->bev));
+	c->closed = 1;
+}
+
+/* Send count requests, one after another, and wait for the last. */
+static void
+run(client *c, int count)
+{
+	c->left = count;
+	c->tries = 0;
+	sendRequest(c);
+	event_base_dispatch(c->base);
+	freeConnection(c);
+}
+
+static void
+report(const char *name, client *c, double secs)
+{
+	auto &l = c->latencies;
+	std::sort(l.begin(), l.end());
+	printf("%-14s: %zu requests in %.2fs, %d handshakes (%d resumed), %.0f handshakes/s",
+		name, l.size(), secs, c->handshakes, c->resumed, c->handshakes / secs);
+	if (!l.empty())
+		printf(", latency us p50 %u p99 %u", l[l.size() / 2], l[std::min(l.size() * 99 / 100, l.size() - 1)]);
+	printf(", %d failed\n", c->failed);
+}
@@ -3,13 +3,27 @@
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <cmath>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
 #include <tuple>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
 
+#include <event2/event.h>
 #include <event2/bufferevent_ssl.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
@@ -21,37 +35,247 @@
 #include <openssl/rand.h>
 
 #define MAX_OUTPUT (512*1024)
-sockaddr_storage local, remote;
-int lenLocal, lenRemote, useSSL, useWapper;
-SSL_CTX *ssl_ctx;
+
+/*
+ * A relayed direction pauses its reader once the writer has limit bytes
+ * queued. limit follows the bandwidth-delay product of the flow: twice what
+ * drains in the reader's round trip plus a loop turn, measured while the
+ * output is backlogged, between MIN_OUTPUT and MAX_FLOW_OUTPUT. Past half
+ * the memory budget (-m) a session may keep no more than its fair share,
+ * past all of it every flow holds at most MIN_OUTPUT.
+ */
+#define MIN_OUTPUT      (16*1024)
+#define MAX_FLOW_OUTPUT (16*1024*1024)
+#define RATE_WINDOW_US  100000
+#define LOOP_DELAY_US   1000
+// a thread's change to the queued total waits until it is this large
+#define BUFFERED_SLACK  (256*1024)
+
+/*
+ * Upstream servers from -r, picked per session by -b policy. A backend is
+ * taken out after FAIL_MAX connects or handshakes in a row failed, counted
+ * from the sessions (passive) and from a TCP connect every -H seconds
+ * (active), and put back by the next one that works. If all are out,
+ * sessions go to all of them as if none was.
+ */
+#define FAIL_MAX    3
+#define RING_POINTS 100
+
+struct backend {
+    std::string name;               // as in -r; also keys its TLS sessions
+    sockaddr_storage addr = {};
+    int     len = sizeof(sockaddr_storage);
+    std::atomic<int> active{0};     // sessions relaying to it
+    std::atomic<int> fails{0};
+    std::atomic<int> down{0};
+    evutil_socket_t checkFd = -1;   // health check in flight, main loop only
+    event  *evCheck = nullptr;
+};
+enum { POLICY_RR, POLICY_LC, POLICY_HASH };
+std::vector<backend> backends;
+std::vector<std::pair<uint32_t, backend*>> ring;   // POLICY_HASH, sorted
+std::atomic<size_t> nextBackend;
+int policy, checkSecs;
+
+/*
+ * With -P, every thread keeps connections to each backend ready, handshake
+ * included, and hands one to a new session instead of connecting for it.
+ * How many follows the sessions a backend got lately and how long a new
+ * connection takes: twice what arrives while one is being made, at most
+ * -P. Checked every WARM_TICK_MS; a pooled connection that the backend
+ * closed or that has been idle for WARM_IDLE_SECS is dropped. Bytes the
+ * backend sends first wait in it for the client.
+ */
+#define WARM_TICK_MS    100
+#define WARM_IDLE_SECS  30
+
+struct warmConn {
+    bufferevent *bev = nullptr;
+    backend *b = nullptr;
+    timeval  since = {};            // connect started, or ready since
+    int      ready = 0;
+};
+struct warmBackend {
+    std::deque<warmConn*> conns;    // connecting ones, then ready ones oldest first
+    size_t  taken = 0;              // sessions since the last tick
+    double  rate = 0;               // sessions per second, smoothed
+    double  connectUs = 0;          // connect (and handshake) time, smoothed
+};
+struct upstreamPool {
+    event_base *base = nullptr;
+    event  *evTick = nullptr;
+    std::vector<warmBackend> byBackend;
+};
+thread_local upstreamPool warm;
+int warmMax;
+
+struct relaySession;
+struct relayFlow {                  // bytes read from src, queued on dst
+    relaySession *s = nullptr;
+    bufferevent *src = nullptr, *dst = nullptr;
+    evbuffer_cb_entry *acct = nullptr;
+    size_t  queued = 0;             // what this flow keeps in dst's output
+    size_t  limit = 4 * MIN_OUTPUT;
+    size_t  rate = 0;               // drain rate while backlogged, bytes/s
+    size_t  drained = 0;
+    size_t  busyUs = 0;
+    timeval last = {};
+};
+struct relaySession {
+    event_base *base = nullptr;
+    relayFlow   up, down;           // up goes from the client to the remote
+    backend    *upstream = nullptr;
+    int         connected = 0;
+    int         bevs = 2;
+};
+std::atomic<long> buffered;
+std::atomic<size_t> relaySessions;
+// what this thread has queued or drained since it last added to buffered
+thread_local long bufferedDelta;
+size_t memBudget = 256 << 20;
+
+sockaddr_storage local;
+int lenLocal, useSSL, useWapper, useSplice, noResume, useKtls;
+SSL_CTX *ssl_ctx, *server_ctx;
 event_base *base;
+
+/*
+ * With -W, OpenSSL and libevent allocate their buffers through per-thread
+ * free lists: a TLS session keeps taking and giving back the same few sizes,
+ * the SSL record buffers (released while idle with SSL_MODE_RELEASE_BUFFERS)
+ * and the evbuffer chains every record passes through in a filter. Blocks
+ * are rounded up to POOL_GRAIN, anything smaller than half a grain or bigger
+ * than the largest class is a plain malloc, and a thread keeps at most
+ * POOL_CACHED bytes of free blocks.
+ */
+#define POOL_GRAIN      1024
+#define POOL_CLASSES    64
+#define POOL_CACHED     (4*1024*1024)
+
+struct poolHeader {
+    size_t  cls;            // POOL_CLASSES for a plain malloc
+    size_t  size;
+};
+struct bufferPool {
+    void   *free[POOL_CLASSES];
+    size_t  cached;
+    int     drained;        // set once the thread is done, later frees skip the lists
+};
+thread_local bufferPool pool;
+
+// upstream TLS sessions (IDs or tickets) by remote address, shared by the workers
+struct sessionCache {
+    std::mutex  lock;
+    std::unordered_map<std::string, SSL_SESSION*> byAddr;
+};
+sessionCache sessions;
+
+struct worker {
+    event_base  *base = nullptr;
+    event       *evNotify = nullptr;
+    evconnlistener *listener = nullptr;
+    int          fds[2] = {-1, -1};
+    std::thread  thread;
+};
+std::vector<worker> workers;
+size_t nextWorker;
+
+struct spliceSession;
+struct spliceDir {
+    spliceSession *s = nullptr;
+    evutil_socket_t from = -1, to = -1;
+    int     pipe[2] = {-1, -1};
+    size_t  pending = 0;
+    size_t  limit = MAX_OUTPUT;
+    int     eof = 0;
+    int     paused = 0;
+    event  *evRead = nullptr;
+    event  *evWrite = nullptr;
+};
+struct spliceSession {
+    event_base  *base = nullptr;
+    evutil_socket_t in = -1, out = -1;
+    event       *evConnect = nullptr;
+    spliceDir    up, down;
+    int          moved = 0;
+    int          ktls = 0;      // out is a kTLS socket handed over after the handshake
+    backend     *upstream = nullptr;
+};
+
 struct options {
-    int     useSSL;
-    int     useWapper;
-    char   *localAddr;
-    char   *remoteAddr;
+    int     useSSL = 0;
+    int     useWapper = 0;
+    int     threads = 0;
+    int     reusePort = 0;
+    int     useSplice = 0;
+    int     noResume = 0;
+    int     useKtls = 0;
+    size_t  memBudget = 256 << 20;
+    int     policy = POLICY_RR;
+    int     checkSecs = 2;
+    int     warmMax = 0;
+    char   *cert = nullptr;
+    char   *key = nullptr;
+    char   *localAddr = nullptr;
+    char   *remoteAddr = nullptr;
     explicit options() = default;
     ~options() = default;
 
     options(options&& rhs) :
-        useSSL(rhs.useSSL), useWapper(rhs.useWapper),
+        useSSL(rhs.useSSL), useWapper(rhs.useWapper), threads(rhs.threads),
+        reusePort(rhs.reusePort), useSplice(rhs.useSplice), noResume(rhs.noResume),
+        useKtls(rhs.useKtls), memBudget(rhs.memBudget), policy(rhs.policy),
+        checkSecs(rhs.checkSecs), warmMax(rhs.warmMax), cert(rhs.cert), key(rhs.key),
         localAddr(rhs.localAddr), remoteAddr(rhs.remoteAddr){
         rhs.useSSL = 0;
         rhs.useWapper = 0;
-        localAddr = nullptr;
-        remoteAddr = nullptr;
+        rhs.threads = 0;
+        rhs.reusePort = 0;
+        rhs.useSplice = 0;
+        rhs.noResume = 0;
+        rhs.useKtls = 0;
+        rhs.memBudget = 0;
+        rhs.policy = POLICY_RR;
+        rhs.checkSecs = 0;
+        rhs.warmMax = 0;
+        rhs.cert = nullptr;
+        rhs.key = nullptr;
+        rhs.localAddr = nullptr;
+        rhs.remoteAddr = nullptr;
     }
 
     options& operator=(options&& rhs) {
 
         useSSL = rhs.useSSL;
         useWapper = rhs.useWapper;
+        threads = rhs.threads;
+        reusePort = rhs.reusePort;
+        useSplice = rhs.useSplice;
+        noResume = rhs.noResume;
+        useKtls = rhs.useKtls;
+        memBudget = rhs.memBudget;
+        policy = rhs.policy;
+        checkSecs = rhs.checkSecs;
+        warmMax = rhs.warmMax;
+        cert = rhs.cert;
+        key = rhs.key;
         localAddr = rhs.localAddr;
         remoteAddr = rhs.remoteAddr;
         rhs.useSSL = 0;
         rhs.useWapper = 0;
-        localAddr = nullptr;
-        remoteAddr = nullptr;
+        rhs.threads = 0;
+        rhs.reusePort = 0;
+        rhs.useSplice = 0;
+        rhs.noResume = 0;
+        rhs.useKtls = 0;
+        rhs.memBudget = 0;
+        rhs.policy = POLICY_RR;
+        rhs.checkSecs = 0;
+        rhs.warmMax = 0;
+        rhs.cert = nullptr;
+        rhs.key = nullptr;
+        rhs.localAddr = nullptr;
+        rhs.remoteAddr = nullptr;
         return *this;
     }
 };
@@ -63,6 +287,59 @@ static void onWrite(bufferevent *, void *);
 static void onClose(bufferevent *, void *);
 static void onEvent(bufferevent *, short, void *);
 static void onAccept(evconnlistener *, evutil_socket_t, sockaddr *, int, void *);
+static void onNotify(evutil_socket_t, short, void *);
+static void onTerm(evutil_socket_t, short, void *);
+static evconnlistener *bindListener(event_base *, worker *, unsigned);
+static void startSession(event_base *, evutil_socket_t);
+static relaySession *relay(bufferevent *, bufferevent *, backend *);
+static bufferevent *newUpstream(event_base *, backend *);
+static void freeBev(bufferevent *);
+static relayFlow *reverse(relayFlow *);
+static void onQueued(evbuffer *, const evbuffer_cb_info *, void *);
+static void account(long);
+static void flowAdapt(relayFlow *);
+static int flowFull(relayFlow *);
+static void releaseBev(bufferevent *, relayFlow *);
+static void dropSession(relaySession *);
+static void parseBackends(char *);
+static uint32_t hashBytes(const void *, size_t, uint32_t);
+static backend *pickBackend(evutil_socket_t);
+static void backendDone(backend *);
+static void backendResult(backend *, int);
+static void onHealthTimer(evutil_socket_t, short, void *);
+static void onHealthCheck(evutil_socket_t, short, void *);
+static void warmInit(event_base *);
+static void warmFree();
+static bufferevent *warmTake(backend *);
+static size_t warmTarget(warmBackend &);
+static void warmFill(backend *);
+static void warmDrop(warmConn *);
+static void onWarmEvent(bufferevent *, short, void *);
+static void onWarmTick(evutil_socket_t, short, void *);
+static SSL *newUpstreamSSL(const std::string &);
+static int onNewSession(SSL *, SSL_SESSION *);
+static void freeSessions();
+static void *poolMalloc(size_t);
+static void *poolRealloc(void *, size_t);
+static void poolFree(void *);
+static void *sslMalloc(size_t, const char *, int);
+static void *sslRealloc(void *, size_t, const char *, int);
+static void sslFree(void *, const char *, int);
+static void poolDrain();
+static bufferevent *acceptSide(event_base *, evutil_socket_t);
+static int ktlsHandoff(bufferevent *, bufferevent *, backend *);
+static int ktlsRecord(spliceDir *);
+static spliceSession *newSplice(event_base *, evutil_socket_t);
+static int startSplice(event_base *, evutil_socket_t, backend *);
+static void onSpliceConnect(evutil_socket_t, short, void *);
+static void spliceConnected(spliceSession *);
+static void onSpliceRead(evutil_socket_t, short, void *);
+static void onSpliceWrite(evutil_socket_t, short, void *);
+static int spliceFlush(spliceDir *);
+static void spliceFallback(spliceSession *);
+static void spliceFree(spliceSession *);
+static void startWorkers(int, int);
+static void stopWorkers();
 
 
 int main(int argc, char **argv)
@@ -71,11 +348,17 @@ int main(int argc, char **argv)
 
     auto opt = getOpt(argc, argv);
 
-    ssl_ctx = nullptr;
+    // before libevent or OpenSSL allocate anything
+    if (opt.useWapper) {
+        event_set_mem_functions(poolMalloc, poolRealloc, poolFree);
+        if (!CRYPTO_set_mem_functions(sslMalloc, sslRealloc, sslFree))
+            fprintf(stderr, "CRYPTO_set_mem_functions failed, OpenSSL uses malloc\n");
+    }
+
+    ssl_ctx = server_ctx = nullptr;
 
-    int lenLocal = sizeof(local), lenRemote = sizeof(remote);
+    lenLocal = sizeof(local);
     memset(&local, 0, lenLocal);
-    memset(&remote, 0, lenRemote);
 
     if (!strchr(opt.localAddr, '.') && !strchr(opt.localAddr, ':')) {
         int port = atoi(opt.localAddr);
@@ -93,28 +376,95 @@ int main(int argc, char **argv)
         usage(argv[0]);
     }
 
-    if (evutil_parse_sockaddr_port(opt.remoteAddr, (sockaddr*)&remote, &lenRemote) < 0) {
-        usage(argv[0]);
-    }
+    if (!opt.remoteAddr) usage(argv[0]);
+    parseBackends(opt.remoteAddr);
+    policy = opt.policy;
+    checkSecs = opt.checkSecs;
 
     if (opt.useSSL) {
         useSSL = 1;
+        noResume = opt.noResume;
         int r = RAND_poll();
         assert(r != 0);
         ssl_ctx = SSL_CTX_new(TLS_method());
+        assert(ssl_ctx);
+        // we only ever connect with ssl_ctx; sessions go to our own cache
+        SSL_CTX_set_session_cache_mode(ssl_ctx,
+            SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(ssl_ctx, onNewSession);
+        if (opt.useKtls && !opt.useWapper) {
+            useKtls = 1;
+            SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+        }
+    }
+
+    if (opt.cert) {
+        server_ctx = SSL_CTX_new(TLS_server_method());
+        assert(server_ctx);
+        if (SSL_CTX_use_certificate_chain_file(server_ctx, opt.cert) != 1 ||
+                SSL_CTX_use_PrivateKey_file(server_ctx, opt.key ? opt.key : opt.cert,
+                    SSL_FILETYPE_PEM) != 1) {
+            ERR_print_errors_fp(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (ssl_ctx || server_ctx) {
+        // SSL_shutdown may write to a socket the peer already closed
+        if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+            perror("signal");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (opt.useWapper) {
+        for (auto ctx : {ssl_ctx, server_ctx})
+            if (ctx) SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
     }
     useWapper = opt.useWapper;
+    memBudget = opt.memBudget;
+    // the kTLS handoff happens at connect time, in the session
+    warmMax = useKtls ? 0 : opt.warmMax;
+    useSplice = opt.useSplice && !opt.useSSL && !server_ctx;
     base = event_base_new();
     assert(base);
 
-    auto listener = evconnlistener_new_bind(base, onAccept, NULL, LEV_OPT_CLOSE_ON_FREE|LEV_OPT_CLOSE_ON_EXEC|LEV_OPT_REUSEABLE,
-        -1, (sockaddr*)&local, lenLocal);
-    assert(listener);
+    auto evTerm = evsignal_new(base, SIGINT, onTerm, base);
+    assert(evTerm);
+    event_add(evTerm, NULL);
+
+    event *evHealth = nullptr;
+    if (backends.size() > 1 && checkSecs > 0) {
+        timeval tv = { .tv_sec = checkSecs, .tv_usec = 0 };
+        evHealth = event_new(base, -1, EV_PERSIST, onHealthTimer, base);
+        assert(evHealth);
+        event_add(evHealth, &tv);
+    }
+
+    warmInit(base);
+    if (opt.threads > 0) startWorkers(opt.threads, opt.reusePort);
+
+    evconnlistener *listener = nullptr;
+    if (!opt.reusePort || opt.threads <= 0) {
+        listener = bindListener(base, nullptr, 0);
+        assert(listener);
+    }
 
     event_base_dispatch(base);
 
-    evconnlistener_free(listener);
+    if (listener) evconnlistener_free(listener);
+    warmFree();
+    stopWorkers();
+    if (evHealth) event_free(evHealth);
+    for (auto &b : backends) {
+        if (b.evCheck) event_free(b.evCheck);
+        if (b.checkFd >= 0) evutil_closesocket(b.checkFd);
+    }
+    event_free(evTerm);
     event_base_free(base);
+    freeSessions();
+    if (ssl_ctx) SSL_CTX_free(ssl_ctx);
+    if (server_ctx) SSL_CTX_free(server_ctx);
+    poolDrain();
 
     return 0;
 }
@@ -122,7 +472,38 @@ static void
 usage(char *argv)
 {
     fprintf(stderr, "Usage:\n"
-        "%s [-s] [-W] <-l listen-addr> <-r remote-addr>\n", argv);
+        "%s [-s [-S] [-k]] [-C cert [-K key]] [-W] [-z] [-m MiB] [-t threads [-R]]\n"
+        "   [-b rr|lc|hash] [-H seconds] [-P conns] <-l listen-addr> <-r remote-addr[,remote-addr...]>\n"
+        " -s        - speak TLS to remote-addr, resuming the session of an earlier\n"
+        "             connection to it when there is one\n"
+        " -S        - do a full TLS handshake for every upstream connection\n"
+        " -k        - let the kernel (kTLS) do the upstream record layer after the\n"
+        "             handshake: a TLS 1.2 session with both directions\n"
+        "             offloaded is relayed as plaintext with splice(2), otherwise\n"
+        "             OpenSSL reads and writes through the kernel; without the\n"
+        "             tls ULP everything stays in user space\n"
+        " -C        - terminate TLS from clients with this PEM certificate chain\n"
+        " -K        - its private key, if not in the -C file\n"
+        " -W        - do TLS in filter bufferevents over plain socket ones, with\n"
+        "             record buffers from per-thread pools and released while a\n"
+        "             session is idle\n"
+        " -z        - relay plaintext sessions with splice(2), without copying\n"
+        "             through user space\n"
+        " -b        - how sessions are spread over several remotes: rr round-robin\n"
+        "             (default), lc to the one with fewest sessions, hash by\n"
+        "             client address on a consistent-hash ring\n"
+        " -H        - with several remotes, try a TCP connect to each one this\n"
+        "             often (default 2, 0 for never); a remote that failed\n"
+        "             3 times in a row gets no sessions until one succeeds\n"
+        " -P        - keep up to this many connections to each remote connected\n"
+        "             (and TLS handshaken) ahead of time, per thread, as many\n"
+        "             as the rate of new sessions needs; not with -k\n"
+        " -m        - memory budget for data queued by all sessions together,\n"
+        "             in MiB (default 256); each direction otherwise queues\n"
+        "             about twice its bandwidth-delay product\n"
+        " -t        - relay on this many worker threads, each with its own event_base\n"
+        " -R        - bind one SO_REUSEPORT listener per worker instead of\n"
+        "             dispatching from a single accept queue\n", argv);
     exit(EXIT_FAILURE);
 } 
 static options 
@@ -130,10 +511,26 @@ getOpt(int argc, char **argv)
 {
     int opt;
     options o;
-    while ((opt = getopt(argc, argv, "sWl:r:")) != -1) {
+    while ((opt = getopt(argc, argv, "sSkC:K:Wzm:b:H:P:t:Rl:r:")) != -1) {
         switch (opt) {
             case 's': o.useSSL = 1; break;
+            case 'S': o.noResume = 1; break;
+            case 'k': o.useKtls = 1; break;
+            case 'C': o.cert = optarg; break;
+            case 'K': o.key = optarg; break;
             case 'W': o.useWapper = 1; break;
+            case 'z': o.useSplice = 1; break;
+            case 'm': o.memBudget = (size_t)atoi(optarg) << 20; break;
+            case 'b':
+                if (!strcmp(optarg, "rr")) o.policy = POLICY_RR;
+                else if (!strcmp(optarg, "lc")) o.policy = POLICY_LC;
+                else if (!strcmp(optarg, "hash")) o.policy = POLICY_HASH;
+                else usage(argv[0]);
+                break;
+            case 'H': o.checkSecs = atoi(optarg); break;
+            case 'P': o.warmMax = atoi(optarg); break;
+            case 't': o.threads = atoi(optarg); break;
+            case 'R': o.reusePort = 1; break;
             case 'l': o.localAddr = optarg; break;
             case 'r': o.remoteAddr = optarg; break;
             default: {
@@ -151,20 +548,20 @@ static void
 onRead(bufferevent *evBuff, void *arg)
 {
 
-    bufferevent *pair = (bufferevent*)arg;
+    relayFlow *f = (relayFlow*)arg;
     auto src = bufferevent_get_input(evBuff);
     auto len = evbuffer_get_length(src);
-    if (!pair) {
+    if (!f->dst) {
         evbuffer_drain(src, len);
         return;
     }
 
-    auto dst = bufferevent_get_output(pair);
+    auto dst = bufferevent_get_output(f->dst);
     evbuffer_add_buffer(dst, src);
 
-    if (evbuffer_get_length(dst) >= MAX_OUTPUT) {
-        bufferevent_setcb(pair, onRead, onWrite, onEvent, evBuff);
-        bufferevent_setwatermark(pair, EV_WRITE, MAX_OUTPUT, MAX_OUTPUT);
+    if (flowFull(f)) {
+        bufferevent_setcb(f->dst, onRead, onWrite, onEvent, reverse(f));
+        bufferevent_setwatermark(f->dst, EV_WRITE, f->queued / 2, 0);
         bufferevent_disable(evBuff, EV_READ);
     }
 }
@@ -172,23 +569,45 @@ onRead(bufferevent *evBuff, void *arg)
 static void 
 onWrite(bufferevent *evBuff, void *arg)
 {
-    bufferevent *pair = (bufferevent *)arg;
-    bufferevent_setcb(evBuff, onRead, NULL, onEvent, pair);
+    relayFlow *f = reverse((relayFlow*)arg);
+    bufferevent_setcb(evBuff, onRead, NULL, onEvent, arg);
     bufferevent_setwatermark(evBuff, EV_WRITE, 0, 0);
-    if(pair) bufferevent_enable(pair, EV_READ);
+    if (f->src) bufferevent_enable(f->src, EV_READ);
 }
 
 static void 
-onClose(bufferevent *evBuff, void *)
+onClose(bufferevent *evBuff, void *arg)
 {
     auto buff = bufferevent_get_output(evBuff);
-    if (!evbuffer_get_length(buff)) bufferevent_free(evBuff);
+    if (!evbuffer_get_length(buff)) releaseBev(evBuff, (relayFlow*)arg);
 
 }
 static void 
 onEvent(bufferevent *evBuff, short what, void *arg)
 {
-    bufferevent *pair = (bufferevent*)arg;
+    relayFlow *f = (relayFlow*)arg;
+    bufferevent *pair = f->dst;
+    auto s = f->s;
+
+    // the upstream side tells how its backend is doing
+    if (f == &s->down && s->upstream && !s->connected) {
+        if (what & BEV_EVENT_CONNECTED) {
+            s->connected = 1;
+            backendResult(s->upstream, 1);
+        } else if (what & BEV_EVENT_ERROR) {
+            backendResult(s->upstream, 0);
+        }
+    }
+
+    if ((what & BEV_EVENT_CONNECTED) && useKtls && pair &&
+            bufferevent_openssl_get_ssl(evBuff) &&
+            !SSL_is_server(bufferevent_openssl_get_ssl(evBuff))) {
+        if (ktlsHandoff(evBuff, pair, s->upstream) == 0) {
+            s->upstream = nullptr;
+            dropSession(s);
+        }
+        return;
+    }
 
     if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
         if (what & BEV_EVENT_ERROR) {
@@ -208,12 +627,12 @@ onEvent(bufferevent *evBuff, short what, void *arg)
             if (evbuffer_get_length(bufferevent_get_output(
                 pair
             ))) {
-                bufferevent_setcb(pair, NULL, onClose, onEvent, NULL);
+                bufferevent_setcb(pair, NULL, onClose, onEvent, reverse(f));
                 bufferevent_disable(pair, EV_READ);
-            } else bufferevent_free(pair);
+            } else releaseBev(pair, reverse(f));
         }
 
-        bufferevent_free(evBuff);
+        releaseBev(evBuff, f);
     }
 
 
@@ -221,41 +640,1112 @@ onEvent(bufferevent *evBuff, short what, void *arg)
 static void 
 onAccept(evconnlistener *ctx, evutil_socket_t sock, sockaddr *addr, int len, void *arg)
 {
+    worker *self = (worker*)arg;
+    if (self || workers.empty()) {
+        startSession(self ? self->base : base, sock);
+        return;
+    }
 
-    auto in = bufferevent_socket_new(base, sock, BEV_OPT_CLOSE_ON_FREE |
-        BEV_OPT_DEFER_CALLBACKS);
+    auto &w = workers[nextWorker++ % workers.size()];
+    if (write(w.fds[1], &sock, sizeof(sock)) != sizeof(sock)) {
+        perror("write");
+        evutil_closesocket(sock);
+    }
+}
+
+static void 
+onNotify(evutil_socket_t fd, short what, void *arg)
+{
+    (void)what;
+    worker *w = (worker*)arg;
+    evutil_socket_t sock;
+
+    while (read(fd, &sock, sizeof(sock)) == sizeof(sock)) {
+        if (sock < 0) {
+            event_base_loopbreak(w->base);
+            return;
+        }
+        startSession(w->base, sock);
+    }
+}
+
+static void 
+onTerm(evutil_socket_t sig, short what, void *arg)
+{
+    (void)what;
+    fprintf(stderr, "Got %i, Terminating...\n", (int)sig);
+    event_base_loopbreak((event_base*)arg);
+}
+
+static evconnlistener *
+bindListener(event_base *base, worker *w, unsigned flags)
+{
+    return evconnlistener_new_bind(base, onAccept, w,
+        LEV_OPT_CLOSE_ON_FREE|LEV_OPT_CLOSE_ON_EXEC|LEV_OPT_REUSEABLE|flags,
+        -1, (sockaddr*)&local, lenLocal);
+}
+
+static void 
+startWorkers(int n, int reusePort)
+{
+    workers = std::vector<worker>(n);
+    for (auto &w : workers) {
+        w.base = event_base_new();
+        assert(w.base);
+        int r = pipe(w.fds);
+        assert(r == 0);
+        evutil_make_socket_nonblocking(w.fds[0]);
+        evutil_make_socket_closeonexec(w.fds[0]);
+        evutil_make_socket_closeonexec(w.fds[1]);
+        w.evNotify = event_new(w.base, w.fds[0], EV_READ | EV_PERSIST, onNotify, &w);
+        assert(w.evNotify);
+        event_add(w.evNotify, NULL);
+        if (reusePort) {
+            w.listener = bindListener(w.base, &w, LEV_OPT_REUSEABLE_PORT);
+            if (!w.listener) {
+                perror("evconnlistener_new_bind");
+                exit(EXIT_FAILURE);
+            }
+        }
+        w.thread = std::thread([base = w.base] {
+            warmInit(base);
+            event_base_dispatch(base);
+            warmFree();
+            poolDrain();
+        });
+    }
+    fprintf(stderr, "started %d workers%s\n", n, reusePort ? " with sharded listeners" : "");
+}
+
+static void 
+stopWorkers()
+{
+    for (auto &w : workers) {
+        evutil_socket_t stop = -1;
+        if (write(w.fds[1], &stop, sizeof(stop)) != sizeof(stop))
+            perror("write");
+    }
+    for (auto &w : workers) {
+        w.thread.join();
+        if (w.listener) evconnlistener_free(w.listener);
+        event_free(w.evNotify);
+        event_base_free(w.base);
+        close(w.fds[0]);
+        close(w.fds[1]);
+    }
+    workers.clear();
+}
+
+static void 
+startSession(event_base *base, evutil_socket_t sock)
+{
+    auto b = pickBackend(sock);
+    if (useSplice && startSplice(base, sock, b) == 0)
+        return;
 
+    auto in = acceptSide(base, sock);
+    if (!in) {
+        backendDone(b);
+        return;
+    }
+
+    if (auto out = warmTake(b)) {
+        auto s = relay(in, out, b);
+        s->connected = 1;
+        // what the backend sent while pooled
+        if (evbuffer_get_length(bufferevent_get_input(out))) onRead(out, &s->down);
+        return;
+    }
+
+    auto out = newUpstream(base, b);
+    if (!out) {
+        bufferevent_free(in);
+        backendDone(b);
+        return;
+    }
+    relay(in, out, b);
+}
+
+/* A connection to b on its way up, for a session or the warm pool. */
+static bufferevent *
+newUpstream(event_base *base, backend *b)
+{
     bufferevent *out;
     if (!useSSL || useWapper) {
         out = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE |
         BEV_OPT_DEFER_CALLBACKS);
     } else {
-        SSL *ssl = SSL_new(ssl_ctx);
+        SSL *ssl = newUpstreamSSL(b->name);
         out = bufferevent_openssl_socket_new(base, -1, ssl, BUFFEREVENT_SSL_CONNECTING,
 		    BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS);
     }
 
-    assert(in && out);
+    assert(out);
 
-    if (bufferevent_socket_connect(out, (sockaddr*)&remote, lenRemote) < 0) {
+    if (bufferevent_socket_connect(out, (sockaddr*)&b->addr, b->len) < 0) {
         perror("bufferevent_socket_connect");
-        bufferevent_free(in);
         bufferevent_free(out);
-        return;
+        backendResult(b, 0);
+        return nullptr;
     }
 
     if (useSSL && useWapper) {
-        SSL *ssl = SSL_new(ssl_ctx);
+        SSL *ssl = newUpstreamSSL(b->name);
         auto bOut = bufferevent_openssl_filter_new(base, out, ssl, BUFFEREVENT_SSL_CONNECTING,
             BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+        if (!bOut) {
+            perror("bufferevent_openssl_filter_new");
+            SSL_free(ssl);
+            bufferevent_free(out);
+            return nullptr;
+        }
+        out = bOut;
+    }
+    return out;
+}
+
+/* The client side of a session, TLS-terminated with -C. */
+static bufferevent *
+acceptSide(event_base *base, evutil_socket_t sock)
+{
+    int flags = BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS;
+    if (!server_ctx) {
+        auto in = bufferevent_socket_new(base, sock, flags);
+        if (!in) evutil_closesocket(sock);
+        return in;
+    }
+
+    SSL *ssl = SSL_new(server_ctx);
+    assert(ssl);
+    if (!useWapper)
+        return bufferevent_openssl_socket_new(base, sock, ssl, BUFFEREVENT_SSL_ACCEPTING, flags);
+
+    auto under = bufferevent_socket_new(base, sock, flags);
+    assert(under);
+    auto in = bufferevent_openssl_filter_new(base, under, ssl, BUFFEREVENT_SSL_ACCEPTING, flags);
+    if (!in) {
         perror("bufferevent_openssl_filter_new");
-        bufferevent_free(in);
-        bufferevent_free(out);
-        return;
+        SSL_free(ssl);
+        bufferevent_free(under);
+    }
+    return in;
+}
+
+static relaySession *
+relay(bufferevent *in, bufferevent *out, backend *b)
+{
+    auto s = new relaySession;
+    s->base = bufferevent_get_base(in);
+    s->upstream = b;
+    s->up.src = s->down.dst = in;
+    s->up.dst = s->down.src = out;
+    for (auto f : {&s->up, &s->down}) {
+        f->s = s;
+        f->acct = evbuffer_add_cb(bufferevent_get_output(f->dst), onQueued, f);
+        assert(f->acct);
     }
+    ++relaySessions;
 
-    bufferevent_setcb(in, onRead, NULL, onEvent, out);
-    bufferevent_setcb(out, onRead, NULL, onEvent, in);
+    bufferevent_setcb(in, onRead, NULL, onEvent, &s->up);
+    bufferevent_setcb(out, onRead, NULL, onEvent, &s->down);
+    bufferevent_setwatermark(out, EV_READ, 0, 0);
     bufferevent_enable(in, EV_READ | EV_WRITE);
     bufferevent_enable(out, EV_READ | EV_WRITE);
+    return s;
+}
+
+static relayFlow *
+reverse(relayFlow *f)
+{
+    return f == &f->s->up ? &f->s->down : &f->s->up;
+}
+
+/* Accounts every byte queued on or written from a relay output, and times
+ * how fast it drains while it has a backlog. */
+static void 
+onQueued(evbuffer *buff, const evbuffer_cb_info *info, void *arg)
+{
+    (void)buff;
+    relayFlow *f = (relayFlow*)arg;
+    timeval now;
+
+    f->queued += info->n_added;
+    f->queued -= info->n_deleted;
+    account((long)info->n_added - (long)info->n_deleted);
+
+    event_base_gettimeofday_cached(f->s->base, &now);
+    if (info->orig_size) {
+        f->busyUs += (now.tv_sec - f->last.tv_sec) * 1000000 + now.tv_usec - f->last.tv_usec;
+        f->drained += info->n_deleted;
+        if (f->busyUs >= RATE_WINDOW_US) flowAdapt(f);
+    }
+    f->last = now;
+}
+
+/* Keeps the workers off the shared buffered for every read and write. */
+static void 
+account(long delta)
+{
+    bufferedDelta += delta;
+    if (bufferedDelta >= BUFFERED_SLACK || bufferedDelta <= -BUFFERED_SLACK) {
+        buffered.fetch_add(bufferedDelta, std::memory_order_relaxed);
+        bufferedDelta = 0;
+    }
+}
+
+/* Folds the last window into the drain rate and sizes limit from it. */
+static void 
+flowAdapt(relayFlow *f)
+{
+    size_t sample = f->drained * 1000000 / f->busyUs;
+    f->rate = f->rate ? (3 * f->rate + sample) / 4 : sample;
+    f->drained = f->busyUs = 0;
+
+    size_t rttUs = 0;
+    tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (f->src && getsockopt(bufferevent_getfd(f->src), IPPROTO_TCP, TCP_INFO, &ti, &len) == 0)
+        rttUs = ti.tcpi_rtt;
+
+    size_t bdp = f->rate * (rttUs + LOOP_DELAY_US) / 1000000;
+    f->limit = std::clamp(2 * bdp, (size_t)MIN_OUTPUT, (size_t)MAX_FLOW_OUTPUT);
+}
+
+/* Whether f has to stop reading until its output drains. */
+static int 
+flowFull(relayFlow *f)
+{
+    if (f->queued >= f->limit) return 1;
+    if (f->queued < MIN_OUTPUT) return 0;
+
+    // off by less than BUFFERED_SLACK per other thread
+    auto total = (size_t)std::max(buffered.load(std::memory_order_relaxed) + bufferedDelta, 0L);
+    if (total >= memBudget) return 1;
+    if (total < memBudget / 2) return 0;
+    return f->queued + reverse(f)->queued >= memBudget / std::max<size_t>(relaySessions, 1);
+}
+
+/* Frees one side of a session, and the session with the second one. f is
+ * the flow bev reads for. */
+static void 
+releaseBev(bufferevent *bev, relayFlow *f)
+{
+    auto in = reverse(f);
+    evbuffer_remove_cb_entry(bufferevent_get_output(bev), in->acct);
+    in->acct = nullptr;
+    account(-(long)in->queued);
+    in->queued = 0;
+    in->dst = f->src = nullptr;
+
+    freeBev(bev);
+    if (--f->s->bevs == 0) dropSession(f->s);
+}
+
+/* The bufferevents are gone already, with their outputs and callbacks. */
+static void 
+dropSession(relaySession *s)
+{
+    account(-(long)(s->up.queued + s->down.queued));
+    --relaySessions;
+    if (s->upstream) backendDone(s->upstream);
+    delete s;
+}
+
+/* -r a,b,...: every remote gets RING_POINTS points on the hash ring. */
+static void 
+parseBackends(char *list)
+{
+    std::vector<std::string> names;
+    for (char *save, *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+        names.push_back(tok);
+    if (names.empty()) {
+        fprintf(stderr, "no remote address\n");
+        exit(EXIT_FAILURE);
+    }
+
+    backends = std::vector<backend>(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        auto &b = backends[i];
+        b.name = names[i];
+        if (evutil_parse_sockaddr_port(b.name.c_str(), (sockaddr*)&b.addr, &b.len) < 0) {
+            fprintf(stderr, "bad remote address %s\n", b.name.c_str());
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t n = 0; n < RING_POINTS; ++n) {
+            auto h = hashBytes(b.name.data(), b.name.size(), 2166136261u);
+            ring.emplace_back(hashBytes(&n, sizeof(n), h), &b);
+        }
+    }
+    std::sort(ring.begin(), ring.end());
+}
+
+/* FNV-1a, continuing from h */
+static uint32_t 
+hashBytes(const void *data, size_t len, uint32_t h)
+{
+    auto p = (const unsigned char*)data;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* The backend for a new session from sock; it counts as active until backendDone. */
+static backend *
+pickBackend(evutil_socket_t sock)
+{
+    size_t n = backends.size();
+    backend *b = nullptr;
+    uint32_t h = 0;
+
+    if (policy == POLICY_HASH) {
+        sockaddr_storage peer;
+        socklen_t len = sizeof(peer);
+        memset(&peer, 0, sizeof(peer));
+        getpeername(sock, (sockaddr*)&peer, &len);
+        // the address alone, a client keeps its backend across ports
+        if (peer.ss_family == AF_INET)
+            h = hashBytes(&((sockaddr_in*)&peer)->sin_addr, sizeof(in_addr), 2166136261u);
+        else if (peer.ss_family == AF_INET6)
+            h = hashBytes(&((sockaddr_in6*)&peer)->sin6_addr, sizeof(in6_addr), 2166136261u);
+    }
+
+    for (int anyState = 0; !b && anyState < 2; ++anyState) {
+        auto usable = [anyState](backend *c) { return anyState || !c->down; };
+        if (policy == POLICY_HASH) {
+            auto it = std::lower_bound(ring.begin(), ring.end(), std::make_pair(h, (backend*)nullptr));
+            for (size_t i = 0; i < ring.size(); ++i, ++it) {
+                if (it == ring.end()) it = ring.begin();
+                if (usable(it->second)) {
+                    b = it->second;
+                    break;
+                }
+            }
+            continue;
+        }
+
+        // least connections starts at the round-robin position to spread ties
+        size_t start = nextBackend++;
+        for (size_t i = 0; i < n; ++i) {
+            auto c = &backends[(start + i) % n];
+            if (!usable(c)) continue;
+            if (policy == POLICY_RR) {
+                b = c;
+                break;
+            }
+            if (!b || c->active < b->active) b = c;
+        }
+    }
+
+    ++b->active;
+    return b;
+}
+
+static void 
+backendDone(backend *b)
+{
+    --b->active;
+}
+
+/* ok is whether a connect (or TLS handshake) to b just worked. */
+static void 
+backendResult(backend *b, int ok)
+{
+    if (ok) {
+        b->fails = 0;
+        if (b->down.exchange(0))
+            fprintf(stderr, "remote %s is up\n", b->name.c_str());
+    } else if (++b->fails >= FAIL_MAX && !b->down.exchange(1)) {
+        fprintf(stderr, "remote %s is down\n", b->name.c_str());
+    }
+}
+
+/* Active health checks: a nonblocking connect to every backend that has
+ * none in flight, given until the next round to complete. */
+static void 
+onHealthTimer(evutil_socket_t fd, short what, void *arg)
+{
+    (void)fd; (void)what;
+    auto base = (event_base*)arg;
+    for (auto &b : backends) {
+        if (b.checkFd >= 0) continue;
+
+        b.checkFd = socket(b.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (b.checkFd < 0) {
+            perror("socket");
+            continue;
+        }
+        if (connect(b.checkFd, (sockaddr*)&b.addr, b.len) < 0 && errno != EINPROGRESS) {
+            evutil_closesocket(b.checkFd);
+            b.checkFd = -1;
+            backendResult(&b, 0);
+            continue;
+        }
+
+        timeval tv = { .tv_sec = checkSecs, .tv_usec = 0 };
+        b.evCheck = event_new(base, b.checkFd, EV_WRITE, onHealthCheck, &b);
+        assert(b.evCheck);
+        event_add(b.evCheck, &tv);
+    }
+}
+
+static void 
+onHealthCheck(evutil_socket_t fd, short what, void *arg)
+{
+    backend *b = (backend*)arg;
+    int err = ETIMEDOUT;
+    socklen_t len = sizeof(err);
+
+    if ((what & EV_WRITE) && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    event_free(b->evCheck);
+    b->evCheck = nullptr;
+    evutil_closesocket(b->checkFd);
+    b->checkFd = -1;
+    backendResult(b, !err);
+}
+
+static void 
+warmInit(event_base *base)
+{
+    if (!warmMax) return;
+    warm.base = base;
+    warm.byBackend = std::vector<warmBackend>(backends.size());
+
+    timeval tv = { .tv_sec = 0, .tv_usec = WARM_TICK_MS * 1000 };
+    warm.evTick = event_new(base, -1, EV_PERSIST, onWarmTick, nullptr);
+    assert(warm.evTick);
+    event_add(warm.evTick, &tv);
+}
+
+static void 
+warmFree()
+{
+    if (!warm.evTick) return;
+    event_free(warm.evTick);
+    warm.evTick = nullptr;
+    for (auto &wb : warm.byBackend) {
+        while (!wb.conns.empty()) warmDrop(wb.conns.front());
+    }
+}
+
+/* A pooled connection to b, or nullptr; also counts the session for sizing. */
+static bufferevent *
+warmTake(backend *b)
+{
+    if (!warm.evTick) return nullptr;
+    auto &wb = warm.byBackend[b - &backends[0]];
+    ++wb.taken;
+
+    bufferevent *bev = nullptr;
+    while (!bev && !wb.conns.empty() && wb.conns.back()->ready) {
+        auto c = wb.conns.back();
+        // the backend may have closed it in this very loop turn
+        char byte;
+        int n = recv(bufferevent_getfd(c->bev), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+            bev = c->bev;
+            wb.conns.pop_back();
+            delete c;
+        } else {
+            warmDrop(c);
+        }
+    }
+    // refills wait for the tick, off the way of this session's first bytes,
+    // unless the pool ran dry
+    if (wb.conns.empty() || !wb.conns.back()->ready) warmFill(b);
+    return bev;
+}
+
+static size_t 
+warmTarget(warmBackend &wb)
+{
+    double refill = wb.connectUs / 1e6 + WARM_TICK_MS / 1e3;
+    return std::min((size_t)warmMax, (size_t)ceil(2 * wb.rate * refill));
+}
+
+/* Connects until b has as many pooled connections as it should. */
+static void 
+warmFill(backend *b)
+{
+    auto &wb = warm.byBackend[b - &backends[0]];
+    if (b->down) return;
+
+    while (wb.conns.size() < warmTarget(wb)) {
+        auto bev = newUpstream(warm.base, b);
+        if (!bev) return;
+
+        auto c = new warmConn;
+        c->bev = bev;
+        c->b = b;
+        event_base_gettimeofday_cached(warm.base, &c->since);
+        bufferevent_setcb(bev, NULL, NULL, onWarmEvent, c);
+        bufferevent_enable(bev, EV_READ);
+        wb.conns.push_front(c);
+    }
+}
+
+static void 
+warmDrop(warmConn *c)
+{
+    auto &conns = warm.byBackend[c->b - &backends[0]].conns;
+    conns.erase(std::find(conns.begin(), conns.end(), c));
+    if (c->ready) freeBev(c->bev);
+    else bufferevent_free(c->bev);
+    delete c;
+}
+
+static void 
+onWarmEvent(bufferevent *bev, short what, void *arg)
+{
+    warmConn *c = (warmConn*)arg;
+    auto &wb = warm.byBackend[c->b - &backends[0]];
+
+    if (what & BEV_EVENT_CONNECTED) {
+        timeval now;
+        event_base_gettimeofday_cached(warm.base, &now);
+        double us = (now.tv_sec - c->since.tv_sec) * 1e6 + now.tv_usec - c->since.tv_usec;
+        wb.connectUs = wb.connectUs ? (3 * wb.connectUs + us) / 4 : us;
+        backendResult(c->b, 1);
+
+        c->ready = 1;
+        c->since = now;
+        wb.conns.erase(std::find(wb.conns.begin(), wb.conns.end(), c));
+        wb.conns.push_back(c);
+        // the backend speaking first gets read, up to a point, but no further
+        bufferevent_setwatermark(bev, EV_READ, 0, MIN_OUTPUT);
+        return;
+    }
+
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        if (!c->ready) backendResult(c->b, 0);
+        warmDrop(c);
+    }
+}
+
+/* Resizes every pool to the latest session rate and lets idle connections go. */
+static void 
+onWarmTick(evutil_socket_t fd, short what, void *arg)
+{
+    (void)fd; (void)what; (void)arg;
+    timeval now;
+    event_base_gettimeofday_cached(warm.base, &now);
+
+    for (size_t i = 0; i < warm.byBackend.size(); ++i) {
+        auto &wb = warm.byBackend[i];
+        wb.rate = 0.8 * wb.rate + 0.2 * wb.taken * 1000 / WARM_TICK_MS;
+        wb.taken = 0;
+        if (wb.rate < 1.0 / WARM_IDLE_SECS) wb.rate = 0;
+
+        size_t ready = std::count_if(wb.conns.begin(), wb.conns.end(),
+            [](warmConn *c) { return c->ready; });
+        size_t target = warmTarget(wb);
+        std::vector<warmConn*> drop;
+        for (auto c : wb.conns) {
+            if (!c->ready) continue;
+            if (ready > target || now.tv_sec - c->since.tv_sec >= WARM_IDLE_SECS) {
+                drop.push_back(c);
+                --ready;
+            }
+        }
+        for (auto c : drop) warmDrop(c);
+        warmFill(&backends[i]);
+    }
+}
+
+/* Give the calling thread's free blocks back to malloc, for good. */
+static void 
+poolDrain()
+{
+    for (auto &head : pool.free) {
+        while (head) {
+            void *next = *(void**)head;
+            free((poolHeader*)head - 1);
+            head = next;
+        }
+    }
+    pool.cached = 0;
+    pool.drained = 1;
+}
+
+static void *
+poolMalloc(size_t size)
+{
+    size_t cls = POOL_CLASSES, block = size;
+    if (size > POOL_GRAIN / 2 && size <= POOL_CLASSES * POOL_GRAIN) {
+        cls = (size - 1) / POOL_GRAIN;
+        block = (cls + 1) * POOL_GRAIN;
+        if (pool.free[cls]) {
+            void *p = pool.free[cls];
+            pool.free[cls] = *(void**)p;
+            pool.cached -= block;
+            ((poolHeader*)p - 1)->size = size;
+            return p;
+        }
+    }
+
+    auto h = (poolHeader*)malloc(sizeof(poolHeader) + block);
+    if (!h) return nullptr;
+    h->cls = cls;
+    h->size = size;
+    return h + 1;
+}
+
+static void *
+poolRealloc(void *p, size_t size)
+{
+    if (!p) return poolMalloc(size);
+    auto h = (poolHeader*)p - 1;
+
+    if (h->cls == POOL_CLASSES && (size <= POOL_GRAIN / 2 || size > POOL_CLASSES * POOL_GRAIN)) {
+        h = (poolHeader*)realloc(h, sizeof(poolHeader) + size);
+        if (!h) return nullptr;
+        h->size = size;
+        return h + 1;
+    }
+    if (h->cls < POOL_CLASSES && size <= (h->cls + 1) * POOL_GRAIN) {
+        h->size = size;
+        return p;
+    }
+
+    void *q = poolMalloc(size);
+    if (q) {
+        memcpy(q, p, std::min(h->size, size));
+        poolFree(p);
+    }
+    return q;
+}
+
+/* A block goes to the list of the thread that frees it. */
+static void 
+poolFree(void *p)
+{
+    if (!p) return;
+    auto h = (poolHeader*)p - 1;
+    auto cls = h->cls;
+    size_t block = (cls + 1) * POOL_GRAIN;
+
+    if (cls == POOL_CLASSES || pool.drained || pool.cached + block > POOL_CACHED) {
+        free(h);
+        return;
+    }
+    *(void**)p = pool.free[cls];
+    pool.free[cls] = p;
+    pool.cached += block;
+}
+
+static void *
+sslMalloc(size_t size, const char *file, int line)
+{
+    (void)file; (void)line;
+    return poolMalloc(size);
+}
+
+static void *
+sslRealloc(void *p, size_t size, const char *file, int line)
+{
+    (void)file; (void)line;
+    return poolRealloc(p, size);
+}
+
+static void 
+sslFree(void *p, const char *file, int line)
+{
+    (void)file; (void)line;
+    poolFree(p);
+}
+
+/* TLS sides send close_notify first: OpenSSL marks the session of a
+ * connection that ends without one as not resumable. */
+static void 
+freeBev(bufferevent *bev)
+{
+    if (auto ssl = bufferevent_openssl_get_ssl(bev)) SSL_shutdown(ssl);
+    bufferevent_free(bev);
+}
+
+/* key names the remote address and has to outlive the SSL */
+static SSL *
+newUpstreamSSL(const std::string &key)
+{
+    SSL *ssl = SSL_new(ssl_ctx);
+    assert(ssl);
+    SSL_set_app_data(ssl, &key);
+    if (noResume) return ssl;
+
+    std::lock_guard<std::mutex> guard(sessions.lock);
+    auto it = sessions.byAddr.find(key);
+    if (it != sessions.byAddr.end()) SSL_set_session(ssl, it->second);
+    return ssl;
+}
+
+/* Keeps the newest session per remote; with TLS 1.3 the tickets come
+ * after the handshake, and a resumed connection may bring fresh ones. */
+static int 
+onNewSession(SSL *ssl, SSL_SESSION *session)
+{
+    auto key = (const std::string*)SSL_get_app_data(ssl);
+    std::lock_guard<std::mutex> guard(sessions.lock);
+    auto &slot = sessions.byAddr[*key];
+    if (slot) SSL_SESSION_free(slot);
+    slot = session;
+    return 1;
+}
+
+static void 
+freeSessions()
+{
+    for (auto &it : sessions.byAddr) SSL_SESSION_free(it.second);
+    sessions.byAddr.clear();
+}
+
+/*
+ * Plaintext fast path: every direction moves data socket->pipe->socket with
+ * splice(2), so the payload never enters user space. At most MAX_OUTPUT bytes
+ * (or the pipe capacity) may sit in a pipe before reading from the source is
+ * paused; that is kernel memory and outside the -m budget. Returns -1 if
+ * the session could not be set up this way and should use bufferevents.
+ */
+static int 
+startSplice(event_base *base, evutil_socket_t sock, backend *b)
+{
+    auto s = newSplice(base, sock);
+    if (!s) return -1;
+    s->upstream = b;
+
+    if (auto out = warmTake(b)) {
+        auto pending = bufferevent_get_input(out);
+        s->out = dup(bufferevent_getfd(out));
+        int ok = s->out >= 0 && evbuffer_get_length(pending) <= s->down.limit;
+        while (ok && evbuffer_get_length(pending)) {
+            int n = evbuffer_write(pending, s->down.pipe[1]);
+            if (n <= 0) ok = 0;
+            else s->down.pending += n;
+        }
+        freeBev(out);
+        if (!ok) {
+            perror("warm connection");
+            spliceFree(s);
+            return 0;
+        }
+        spliceConnected(s);
+        if (s->down.pending && spliceFlush(&s->down) < 0) spliceFree(s);
+        return 0;
+    }
+
+    s->out = socket(b->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->out < 0 ||
+            (connect(s->out, (sockaddr*)&b->addr, b->len) < 0 && errno != EINPROGRESS)) {
+        perror("connect");
+        backendResult(b, 0);
+        spliceFree(s);
+        return 0;
+    }
+
+    s->evConnect = event_new(base, s->out, EV_WRITE, onSpliceConnect, s);
+    assert(s->evConnect);
+    event_add(s->evConnect, NULL);
+    return 0;
+}
+
+static void 
+onSpliceConnect(evutil_socket_t fd, short what, void *arg)
+{
+    (void)what;
+    spliceSession *s = (spliceSession*)arg;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        fprintf(stderr, "connect: %s\n", strerror(err ? err : errno));
+        backendResult(s->upstream, 0);
+        spliceFree(s);
+        return;
+    }
+    backendResult(s->upstream, 1);
+    spliceConnected(s);
+}
+
+/* Both sockets are up: start moving bytes in each direction. */
+static void 
+spliceConnected(spliceSession *s)
+{
+    s->up.from = s->in;
+    s->up.to = s->out;
+    s->down.from = s->out;
+    s->down.to = s->in;
+    for (auto d : {&s->up, &s->down}) {
+        d->evRead = event_new(s->base, d->from, EV_READ | EV_PERSIST, onSpliceRead, d);
+        d->evWrite = event_new(s->base, d->to, EV_WRITE | EV_PERSIST, onSpliceWrite, d);
+        assert(d->evRead && d->evWrite);
+        event_add(d->evRead, NULL);
+    }
+}
+
+static void 
+onSpliceRead(evutil_socket_t fd, short what, void *arg)
+{
+    (void)fd; (void)what;
+    spliceDir *d = (spliceDir*)arg;
+    auto s = d->s;
+
+    auto n = splice(d->from, NULL, d->pipe[1], NULL, d->limit - d->pending,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        d->pending += n;
+        s->moved = 1;
+    } else if (n == 0) {
+        d->eof = 1;
+        event_del(d->evRead);
+    } else if (errno == EAGAIN) {
+        // the pipe ran out of slots before the socket ran dry
+        if (d->pending) {
+            d->paused = 1;
+            event_del(d->evRead);
+        }
+    } else if ((errno == EINVAL || errno == ENOSYS) && !s->moved) {
+        spliceFallback(s);
+        return;
+    } else if (errno == EIO && s->ktls && d->from == s->out) {
+        // a record other than data, which splice cannot pass on
+        if (ktlsRecord(d) < 0) {
+            spliceFree(s);
+            return;
+        }
+    } else {
+        if (errno != ECONNRESET) perror("splice");
+        spliceFree(s);
+        return;
+    }
+
+    if (spliceFlush(d) < 0) spliceFree(s);
+}
+
+static void 
+onSpliceWrite(evutil_socket_t fd, short what, void *arg)
+{
+    (void)fd; (void)what;
+    spliceDir *d = (spliceDir*)arg;
+    if (spliceFlush(d) < 0) spliceFree(d->s);
+}
+
+static int 
+spliceFlush(spliceDir *d)
+{
+    while (d->pending) {
+        auto n = splice(d->pipe[0], NULL, d->to, NULL, d->pending,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            d->pending -= n;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            if (n < 0 && errno != EPIPE && errno != ECONNRESET) perror("splice");
+            return -1;
+        }
+    }
+
+    if (d->pending) {
+        event_add(d->evWrite, NULL);
+        if (d->pending >= d->limit && !d->paused) {
+            d->paused = 1;
+            event_del(d->evRead);
+        }
+        return 0;
+    }
+
+    event_del(d->evWrite);
+    if (d->paused && !d->eof) {
+        d->paused = 0;
+        event_add(d->evRead, NULL);
+    }
+    if (d->eof) {
+        auto peer = d == &d->s->up ? &d->s->down : &d->s->up;
+        if (peer->eof && !peer->pending) return -1;
+        shutdown(d->to, SHUT_WR);
+    }
+    return 0;
+}
+
+/*
+ * splice() stopped at a kTLS record that is not application data: read it
+ * with its type. A close_notify ends the direction, other alerts the
+ * session; handshake records can only be a TLS 1.2 HelloRequest, which a
+ * client may ignore. Returns -1 if the session has to go.
+ */
+static int 
+ktlsRecord(spliceDir *d)
+{
+    unsigned char data[SSL3_RT_MAX_PLAIN_LENGTH];
+    char control[CMSG_SPACE(sizeof(unsigned char))];
+    iovec iov = { data, sizeof(data) };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    auto n = recvmsg(d->from, &msg, MSG_DONTWAIT);
+    if (n < 0) {
+        if (errno == EAGAIN) return 0;
+        if (errno != ECONNRESET) perror("recvmsg");
+        return -1;
+    }
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    int type = n == 0 ? 0 : cmsg && cmsg->cmsg_level == SOL_TLS &&
+        cmsg->cmsg_type == TLS_GET_RECORD_TYPE ? *CMSG_DATA(cmsg) : -1;
+
+    if (n == 0 || (type == SSL3_RT_ALERT && n >= 2 && data[1] == SSL_AD_CLOSE_NOTIFY)) {
+        d->eof = 1;
+        event_del(d->evRead);
+        return 0;
+    }
+    if (type == SSL3_RT_HANDSHAKE)
+        return 0;
+    if (type == SSL3_RT_ALERT)
+        fprintf(stderr, "upstream TLS alert: %s\n", SSL_alert_desc_string_long(n >= 2 ? data[1] : 0));
+    else
+        fprintf(stderr, "upstream kTLS record of type %d\n", type);
+    return -1;
+}
+
+/*
+ * Pipes for a splice session on the accepted socket sock; the caller
+ * provides the upstream socket. Returns nullptr, leaving sock alone, if
+ * the pipes could not be made.
+ */
+static spliceSession *
+newSplice(event_base *base, evutil_socket_t sock)
+{
+    auto s = new spliceSession;
+    s->base = base;
+    s->in = sock;
+
+    for (auto d : {&s->up, &s->down}) {
+        d->s = s;
+        if (pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            perror("pipe2");
+            s->in = -1;
+            spliceFree(s);
+            return nullptr;
+        }
+        int sz = fcntl(d->pipe[1], F_SETPIPE_SZ, MAX_OUTPUT);
+        if (sz < 0) sz = fcntl(d->pipe[1], F_GETPIPE_SZ);
+        if (sz > 0 && sz < MAX_OUTPUT) d->limit = sz;
+    }
+    return s;
+}
+
+/*
+ * The upstream handshake of out is done. If OpenSSL moved both directions
+ * of the record layer into the kernel, the socket now carries plaintext for
+ * us, so the session moves to the splice relay: whatever the bufferevents
+ * still hold goes into the pipes first. Returns 0 if it moved; otherwise
+ * the bufferevents carry on, with OpenSSL's I/O going through the kernel
+ * for what was offloaded. TLS 1.3 stays with OpenSSL: its session tickets
+ * and KeyUpdates come after the handshake and need the SSL.
+ */
+static int 
+ktlsHandoff(bufferevent *out, bufferevent *in, backend *b)
+{
+    static std::atomic<int> warned;
+    SSL *ssl = bufferevent_openssl_get_ssl(out);
+    int send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    int recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+
+    if (!send && !warned.exchange(1))
+        fprintf(stderr, "kTLS not available (no tls ULP?), encrypting in user space\n");
+    if (!send || !recv || SSL_version(ssl) != TLS1_2_VERSION || SSL_pending(ssl))
+        return -1;
+
+    int inFd = dup(bufferevent_getfd(in));
+    int outFd = dup(bufferevent_getfd(out));
+    spliceSession *s = inFd < 0 || outFd < 0 ? nullptr : newSplice(bufferevent_get_base(in), inFd);
+    if (!s) {
+        if (inFd >= 0) close(inFd);
+        if (outFd >= 0) close(outFd);
+        return -1;
+    }
+    s->out = outFd;
+    s->ktls = 1;
+
+    // what is queued has to fit the pipes
+    auto toUp = evbuffer_get_length(bufferevent_get_output(out)) +
+        evbuffer_get_length(bufferevent_get_input(in));
+    auto toDown = evbuffer_get_length(bufferevent_get_input(out)) +
+        evbuffer_get_length(bufferevent_get_output(in));
+    if (toUp > s->up.limit || toDown > s->down.limit) {
+        spliceFree(s);
+        return -1;
+    }
+    s->upstream = b;
+
+    // oldest bytes first in each direction
+    std::tuple<spliceDir*, evbuffer*> queued[] = {
+        { &s->up, bufferevent_get_output(out) }, { &s->up, bufferevent_get_input(in) },
+        { &s->down, bufferevent_get_output(in) }, { &s->down, bufferevent_get_input(out) },
+    };
+    for (auto [d, buff] : queued) {
+        while (evbuffer_get_length(buff)) {
+            int n = evbuffer_write(buff, d->pipe[1]);
+            if (n <= 0) {
+                perror("write");
+                spliceFree(s);
+                bufferevent_free(in);
+                bufferevent_free(out);
+                return 0;
+            }
+            d->pending += n;
+        }
+    }
+
+    // the SSL goes away without a close_notify, the session stays resumable
+    SSL_set_quiet_shutdown(ssl, 1);
+    SSL_shutdown(ssl);
+    bufferevent_free(in);
+    bufferevent_free(out);
+
+    spliceConnected(s);
+    for (auto d : {&s->up, &s->down}) {
+        if (d->pending && spliceFlush(d) < 0) {
+            spliceFree(s);
+            break;
+        }
+    }
+    return 0;
+}
+
+/* splice(2) refused these sockets before any byte moved: hand them over to
+ * the regular bufferevent relay. */
+static void 
+spliceFallback(spliceSession *s)
+{
+    auto in = bufferevent_socket_new(s->base, s->in, BEV_OPT_CLOSE_ON_FREE |
+        BEV_OPT_DEFER_CALLBACKS);
+    auto out = bufferevent_socket_new(s->base, s->out, BEV_OPT_CLOSE_ON_FREE |
+        BEV_OPT_DEFER_CALLBACKS);
+    assert(in && out);
+
+    auto b = s->upstream;
+    s->in = s->out = -1;
+    s->upstream = nullptr;
+    spliceFree(s);
+    relay(in, out, b);
+}
+
+static void 
+spliceFree(spliceSession *s)
+{
+    if (s->evConnect) event_free(s->evConnect);
+    for (auto d : {&s->up, &s->down}) {
+        if (d->evRead) event_free(d->evRead);
+        if (d->evWrite) event_free(d->evWrite);
+        if (d->pipe[0] >= 0) close(d->pipe[0]);
+        if (d->pipe[1] >= 0) close(d->pipe[1]);
+    }
+    if (s->in >= 0) evutil_closesocket(s->in);
+    if (s->out >= 0) evutil_closesocket(s->out);
+    if (s->upstream) backendDone(s->upstream);
+    delete s;
 }
\ No newline at end of file
@@ -0,0 +1,461 @@
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/buffer.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+#include <event2/thread.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+enum mode {
+    MODE_ECHO,
+    MODE_CONN,
+    MODE_BULK,
+};
+
+sockaddr_storage target;
+int lenTarget;
+mode benchMode;
+SSL_CTX *serverCtx = nullptr;
+
+struct options {
+    int     serve = 0;
+    mode    m = MODE_ECHO;
+    int     threads = 1;
+    int     conns = 1;
+    int     msgSize = 4096;
+    int     seconds = 5;
+    int     pid = 0;
+    char   *cert = nullptr;     // -T, PEM chain optionally followed by ",key"
+    char   *addr = nullptr;
+};
+
+struct stats {
+    event_base *base = nullptr;
+    size_t      bytes = 0;
+    size_t      msgs = 0;
+    size_t      errors = 0;
+    size_t      conns = 0;
+    char       *msg = nullptr;
+    int         msgSize = 0;
+    mode        m = MODE_ECHO;
+    // conn mode: connect start per connection, and connect-to-reply times
+    std::unordered_map<bufferevent*, timeval> starts;
+    std::vector<uint32_t> latencies;
+};
+
+static void usage(char *);
+static options getOpt(int, char **);
+static void runServer(const options &);
+static SSL_CTX *newServerContext(char *);
+static void runClient(const options &);
+static void startConn(stats *);
+static double cpuSeconds(int);
+static void onAccept(evconnlistener *, evutil_socket_t, sockaddr *, int, void *);
+static void onEcho(bufferevent *, void *);
+static void onPing(bufferevent *, void *);
+static void onReply(bufferevent *, void *);
+static void onFill(bufferevent *, void *);
+static void onSent(evbuffer *, const evbuffer_cb_info *, void *);
+static void onSink(bufferevent *, void *);
+static void onEvent(bufferevent *, short, void *);
+static void onTerm(evutil_socket_t, short, void *);
+
+int
+main(int argc, char **argv)
+{
+    auto opt = getOpt(argc, argv);
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror("signal");
+        return 1;
+    }
+
+    if (evthread_use_pthreads() < 0) {
+        fprintf(stderr, "evthread_use_pthreads failed\n");
+        return 1;
+    }
+
+    lenTarget = sizeof(target);
+    memset(&target, 0, lenTarget);
+    if (evutil_parse_sockaddr_port(opt.addr, (sockaddr*)&target, &lenTarget) < 0)
+        usage(argv[0]);
+
+    benchMode = opt.m;
+    if (opt.serve) runServer(opt);
+    else runClient(opt);
+
+    return 0;
+}
+
+static void
+usage(char *argv)
+{
+    fprintf(stderr, "Usage:\n"
+        "%s [-S [-T cert[,key]]] [-m echo|conn|bulk] [-t threads] [-c conns] [-s msg-size]\n"
+        "   [-d seconds] [-p pid] <addr>\n"
+        " -S        - run a server on addr instead of the client; it echoes\n"
+        "             everything back, or discards it in bulk mode\n"
+        " -T        - the server speaks TLS with this PEM certificate chain\n"
+        "             and key (from the same file unless given), e.g. as the\n"
+        "             remote of a proxy -s\n"
+        " -m        - echo: ping-pong msg-size messages and report throughput\n"
+        "             conn: connect, send msg-size bytes (none if 0), wait for\n"
+        "             the first reply byte or EOF, reset and reconnect; report\n"
+        "             connections per second and connect-to-reply latency\n"
+        "             bulk: stream msg-size chunks one way as fast as possible\n"
+        "             and report throughput\n"
+        " -t        - event loop threads (default 1)\n"
+        " -c        - client connections, spread over the threads (default 1)\n"
+        " -s        - ping-pong message size in bytes (default 4096)\n"
+        " -d        - client run time in seconds (default 5)\n"
+        " -p        - also report the CPU time process pid (e.g. the proxy)\n"
+        "             used during the run, per GB moved or per connection\n", argv);
+    exit(EXIT_FAILURE);
+}
+
+static options
+getOpt(int argc, char **argv)
+{
+    int opt;
+    options o;
+    while ((opt = getopt(argc, argv, "ST:m:t:c:s:d:p:")) != -1) {
+        switch (opt) {
+            case 'S': o.serve = 1; break;
+            case 'T': o.cert = optarg; break;
+            case 'm': {
+                if (!strcmp(optarg, "echo")) o.m = MODE_ECHO;
+                else if (!strcmp(optarg, "conn")) o.m = MODE_CONN;
+                else if (!strcmp(optarg, "bulk")) o.m = MODE_BULK;
+                else usage(argv[0]);
+                break;
+            }
+            case 't': o.threads = atoi(optarg); break;
+            case 'c': o.conns = atoi(optarg); break;
+            case 's': o.msgSize = atoi(optarg); break;
+            case 'd': o.seconds = atoi(optarg); break;
+            case 'p': o.pid = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || o.threads < 1 || o.msgSize < (o.m != MODE_CONN) || o.seconds < 1 ||
+            (!o.serve && o.conns < o.threads) || (o.cert && !o.serve))
+        usage(argv[0]);
+
+    o.addr = argv[optind];
+    return o;
+}
+
+/* Every server thread owns an event_base and a listener bound with
+ * SO_REUSEPORT, so the server never becomes the bottleneck of the run. */
+static void
+runServer(const options &o)
+{
+    std::vector<event_base*> bases(o.threads);
+    std::vector<evconnlistener*> listeners(o.threads);
+    std::vector<std::thread> threads;
+
+    if (o.cert) serverCtx = newServerContext(o.cert);
+    for (int i = 0; i < o.threads; ++i) {
+        bases[i] = event_base_new();
+        assert(bases[i]);
+        listeners[i] = evconnlistener_new_bind(bases[i], onAccept, bases[i],
+            LEV_OPT_CLOSE_ON_FREE|LEV_OPT_CLOSE_ON_EXEC|LEV_OPT_REUSEABLE|LEV_OPT_REUSEABLE_PORT,
+            -1, (sockaddr*)&target, lenTarget);
+        if (!listeners[i]) {
+            perror("evconnlistener_new_bind");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    auto evTerm = evsignal_new(bases[0], SIGINT, onTerm, &bases);
+    assert(evTerm);
+    event_add(evTerm, NULL);
+
+    fprintf(stderr, "%s%s server on %s with %d threads\n",
+        benchMode == MODE_BULK ? "discard" : "echo", serverCtx ? " TLS" : "", o.addr, o.threads);
+    for (int i = 1; i < o.threads; ++i)
+        threads.emplace_back(event_base_dispatch, bases[i]);
+    event_base_dispatch(bases[0]);
+
+    for (auto &t : threads) t.join();
+    event_free(evTerm);
+    for (int i = 0; i < o.threads; ++i) {
+        evconnlistener_free(listeners[i]);
+        event_base_free(bases[i]);
+    }
+    if (serverCtx) SSL_CTX_free(serverCtx);
+}
+
+static SSL_CTX *
+newServerContext(char *cert)
+{
+    auto key = strchr(cert, ',');
+    if (key) *key++ = '\0';
+
+    auto ctx = SSL_CTX_new(TLS_server_method());
+    assert(ctx);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, key ? key : cert, SSL_FILETYPE_PEM) != 1) {
+        ERR_print_errors_fp(stderr);
+        exit(EXIT_FAILURE);
+    }
+    return ctx;
+}
+
+static void
+runClient(const options &o)
+{
+    std::vector<stats> st(o.threads);
+    std::vector<std::thread> threads;
+    timeval tv = { .tv_sec = o.seconds, .tv_usec = 0 };
+    char *msg = new char[o.msgSize];
+    memset(msg, 'x', o.msgSize);
+
+    for (int i = 0; i < o.threads; ++i) {
+        auto &s = st[i];
+        s.base = event_base_new();
+        assert(s.base);
+        s.msg = msg;
+        s.msgSize = o.msgSize;
+        s.m = o.m;
+
+        int n = o.conns / o.threads + (i < o.conns % o.threads);
+        for (int c = 0; c < n; ++c) startConn(&s);
+        event_base_loopexit(s.base, &tv);
+    }
+
+    timeval start, end;
+    double cpu = o.pid ? cpuSeconds(o.pid) : 0;
+    evutil_gettimeofday(&start, NULL);
+    for (auto &s : st)
+        threads.emplace_back(event_base_dispatch, s.base);
+    for (auto &t : threads) t.join();
+    evutil_gettimeofday(&end, NULL);
+    if (o.pid) cpu = cpuSeconds(o.pid) - cpu;
+
+    size_t bytes = 0, msgs = 0, errors = 0, conns = 0;
+    std::vector<uint32_t> latencies;
+    for (auto &s : st) {
+        bytes += s.bytes;
+        msgs += s.msgs;
+        errors += s.errors;
+        conns += s.conns;
+        latencies.insert(latencies.end(), s.latencies.begin(), s.latencies.end());
+        event_base_free(s.base);
+    }
+    delete[] msg;
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    if (o.m == MODE_CONN) {
+        std::sort(latencies.begin(), latencies.end());
+        printf("threads %d conns %d: %.0f conns/s, %zu errors\n",
+            o.threads, o.conns, conns / secs, errors);
+        if (!latencies.empty())
+            printf("connect to reply us: p50 %u, p99 %u\n", latencies[latencies.size() / 2],
+                latencies[std::min(latencies.size() * 99 / 100, latencies.size() - 1)]);
+        if (o.pid && conns)
+            printf("pid %d: %.2f cpu seconds, %.0f cpu us/conn\n",
+                o.pid, cpu, cpu * 1e6 / conns);
+        return;
+    }
+    printf("threads %d conns %d size %d: %.1f MB/s, %.0f msgs/s, %zu errors\n",
+        o.threads, o.conns, o.msgSize, bytes / secs / (1 << 20), msgs / secs, errors);
+    if (o.pid && bytes)
+        printf("pid %d: %.2f cpu seconds, %.2f cpu seconds/GB\n",
+            o.pid, cpu, cpu / (bytes / (double)(1 << 30)));
+}
+
+/* utime + stime of pid, from /proc/<pid>/stat */
+static double
+cpuSeconds(int pid)
+{
+    std::ifstream f("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if (!std::getline(f, line)) {
+        fprintf(stderr, "cannot read stats of pid %d\n", pid);
+        exit(EXIT_FAILURE);
+    }
+
+    // the fields after the parenthesised command start with the state (3rd)
+    auto p = line.c_str() + line.rfind(')') + 2;
+    unsigned long utime = 0, stime = 0;
+    sscanf(p, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+    return (utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static void
+startConn(stats *s)
+{
+    auto bev = bufferevent_socket_new(s->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    assert(bev);
+    if (s->m == MODE_CONN) {
+        bufferevent_setcb(bev, onReply, NULL, onEvent, s);
+    } else if (s->m == MODE_BULK) {
+        bufferevent_setcb(bev, NULL, onFill, onEvent, s);
+        bufferevent_setwatermark(bev, EV_WRITE, 4 * s->msgSize, 0);
+        evbuffer_add_cb(bufferevent_get_output(bev), onSent, s);
+    } else {
+        bufferevent_setcb(bev, onPing, NULL, onEvent, s);
+        bufferevent_setwatermark(bev, EV_READ, s->msgSize, 0);
+    }
+    if (s->m == MODE_CONN) evutil_gettimeofday(&s->starts[bev], NULL);
+    if (bufferevent_socket_connect(bev, (sockaddr*)&target, lenTarget) < 0) {
+        perror("bufferevent_socket_connect");
+        exit(EXIT_FAILURE);
+    }
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+static void
+onAccept(evconnlistener *ctx, evutil_socket_t sock, sockaddr *addr, int len, void *arg)
+{
+    (void)ctx; (void)addr; (void)len;
+    bufferevent *bev;
+    if (serverCtx) {
+        auto ssl = SSL_new(serverCtx);
+        assert(ssl);
+        bev = bufferevent_openssl_socket_new((event_base*)arg, sock, ssl,
+            BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+        assert(bev);
+        // clients stop by closing, without a close_notify
+        bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+    } else {
+        bev = bufferevent_socket_new((event_base*)arg, sock, BEV_OPT_CLOSE_ON_FREE);
+        assert(bev);
+    }
+    bufferevent_setcb(bev, benchMode == MODE_BULK ? onSink : onEcho, NULL, onEvent, NULL);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+static void
+onEcho(bufferevent *bev, void *arg)
+{
+    (void)arg;
+    bufferevent_write_buffer(bev, bufferevent_get_input(bev));
+}
+
+static void
+onSink(bufferevent *bev, void *arg)
+{
+    (void)arg;
+    auto in = bufferevent_get_input(bev);
+    evbuffer_drain(in, evbuffer_get_length(in));
+}
+
+/* keep 16 chunks queued, all referencing the same message */
+static void
+onFill(bufferevent *bev, void *arg)
+{
+    stats *s = (stats*)arg;
+    auto out = bufferevent_get_output(bev);
+
+    while (evbuffer_get_length(out) < 16 * (size_t)s->msgSize)
+        evbuffer_add_reference(out, s->msg, s->msgSize, NULL, NULL);
+}
+
+/* Counts bulk bytes as they go to the socket; what is still queued at the
+ * end of the run was never sent. */
+static void
+onSent(evbuffer *buf, const evbuffer_cb_info *info, void *arg)
+{
+    (void)buf;
+    stats *s = (stats*)arg;
+    s->bytes += info->n_deleted;
+    s->msgs = s->bytes / s->msgSize;
+}
+
+static void
+onPing(bufferevent *bev, void *arg)
+{
+    stats *s = (stats*)arg;
+    auto in = bufferevent_get_input(bev);
+
+    while (evbuffer_get_length(in) >= (size_t)s->msgSize) {
+        evbuffer_drain(in, s->msgSize);
+        s->bytes += s->msgSize;
+        ++s->msgs;
+        bufferevent_write(bev, s->msg, s->msgSize);
+    }
+}
+
+/* An abortive close keeps the client from piling up TIME_WAIT sockets
+ * and running out of ephemeral ports during long runs. */
+static void
+onReply(bufferevent *bev, void *arg)
+{
+    stats *s = (stats*)arg;
+    linger lg = { .l_onoff = 1, .l_linger = 0 };
+    timeval now;
+
+    ++s->conns;
+    evutil_gettimeofday(&now, NULL);
+    auto it = s->starts.find(bev);
+    s->latencies.push_back((now.tv_sec - it->second.tv_sec) * 1000000 +
+        (now.tv_usec - it->second.tv_usec));
+    s->starts.erase(it);
+    setsockopt(bufferevent_getfd(bev), SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    bufferevent_free(bev);
+    startConn(s);
+}
+
+static void
+onEvent(bufferevent *bev, short what, void *arg)
+{
+    stats *s = (stats*)arg;
+
+    // on the server, a TLS handshake is done
+    if ((what & BEV_EVENT_CONNECTED) && !s) return;
+    if (what & BEV_EVENT_CONNECTED) {
+        int one = 1;
+        setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (s->m == MODE_BULK) onFill(bev, s);
+        else if (s->msgSize) bufferevent_write(bev, s->msg, s->msgSize);
+        return;
+    }
+
+    if (s && s->m == MODE_CONN && (what & BEV_EVENT_EOF)) {
+        onReply(bev, s);
+        return;
+    }
+
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        if (s) {
+            ++s->errors;
+            if (what & BEV_EVENT_ERROR) perror("connection error");
+            s->starts.erase(bev);
+        }
+        bufferevent_free(bev);
+    }
+}
+
+static void
+onTerm(evutil_socket_t sig, short what, void *arg)
+{
+    (void)what;
+    auto bases = (std::vector<event_base*>*)arg;
+    fprintf(stderr, "Got %i, Terminating...\n", (int)sig);
+    for (auto b : *bases) event_base_loopbreak(b);
+}